@@ -56,6 +56,7 @@
 #include <termios.h>
 #include <dlfcn.h>
 #include <sched.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -144,6 +145,8 @@ static s32 out_fd,                    /* Persistent fd for out_file       */
            fsrv_ctl_fd,               /* Fork server control pipe (write) */
            fsrv_st_fd;                /* Fork server status pipe (read)   */
 
+static u8  fsrv_tmout;                /* Fork server enforces timeouts?   */
+
 static s32 forksrv_pid,               /* PID of the fork server           */
            child_pid = -1,            /* PID of the fuzzed program        */
            out_dir_fd = -1;           /* FD of the lock file              */
@@ -287,6 +290,21 @@ static u32 extras_cnt;                /* Total number of tokens read      */
 static struct extra_data* a_extras;   /* Automatically selected extras    */
 static u32 a_extras_cnt;              /* Total number of tokens available */
 
+/* Comparison tokens recorded by the ReZZan runtime. The layout must match
+   the one in rezzan_runtime.c. */
+
+struct rezzan_dict {
+  u32 count;                          /* Number of slots filled           */
+  u8  seen[REZZAN_DICT_SEEN / 8];     /* Filter of tokens already sent    */
+  struct {
+    u8 len;                           /* Token length                     */
+    u8 data[MAX_AUTO_EXTRA];          /* Token data                       */
+  } tokens[REZZAN_DICT_MAX];
+};
+
+static struct rezzan_dict* rezzan_dict; /* SHM with comparison tokens     */
+static s32 rezzan_dict_shm_id = -1;   /* ID of the token SHM region       */
+
 static u8* (*post_handler)(u8* buf, u32* len);
 
 /* Interesting values, as per config.h */
@@ -1230,6 +1248,7 @@ static inline void classify_counts(u32* mem) {
 static void remove_shm(void) {
 
   shmctl(shm_id, IPC_RMID, NULL);
+  if (rezzan_dict_shm_id >= 0) shmctl(rezzan_dict_shm_id, IPC_RMID, NULL);
 
 }
 
@@ -1398,6 +1417,26 @@ EXP_ST void setup_shm(void) {
   
   if (trace_bits == (void *)-1) PFATAL("shmat() failed");
 
+  /* Optionally, let the ReZZan runtime report the constants that strcmp()
+     and friends are compared against, so that we can use them as extras. */
+
+  if (getenv("AFL_REZZAN_DICT") && !dumb_mode) {
+
+    rezzan_dict_shm_id = shmget(IPC_PRIVATE, sizeof(struct rezzan_dict),
+                                IPC_CREAT | IPC_EXCL | 0600);
+
+    if (rezzan_dict_shm_id < 0) PFATAL("shmget() failed");
+
+    shm_str = alloc_printf("%d", rezzan_dict_shm_id);
+    setenv(REZZAN_DICT_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+    rezzan_dict = shmat(rezzan_dict_shm_id, NULL, 0);
+
+    if (rezzan_dict == (void *)-1) PFATAL("shmat() failed");
+
+  }
+
 }
 
 
@@ -1904,6 +1943,26 @@ sort_a_extras:
 }
 
 
+/* Turn comparison tokens reported by the ReZZan runtime into auto extras.
+   Called after every run, so the check for an empty buffer must be cheap. */
+
+static inline void harvest_rezzan_dict(void) {
+
+  u32 i, cnt;
+
+  if (!rezzan_dict || !rezzan_dict->count) return;
+
+  cnt = MIN(rezzan_dict->count, REZZAN_DICT_MAX);
+
+  for (i = 0; i < cnt; i++)
+    maybe_add_auto(rezzan_dict->tokens[i].data,
+                   MIN(rezzan_dict->tokens[i].len, MAX_AUTO_EXTRA));
+
+  rezzan_dict->count = 0;
+
+}
+
+
 /* Save automatically generated extras. */
 
 static void save_auto(void) {
@@ -2150,8 +2209,20 @@ EXP_ST void init_forkserver(char** argv) {
      Otherwise, try to figure out what went wrong. */
 
   if (rlen == 4) {
-    OKF("All right - fork server is up.");
+
+    /* Newer runtimes announce that they can kill hung children on their own,
+       which spares us the itimer round-trip in run_target(). */
+
+    fsrv_tmout = (status == FORKSRV_TMOUT_SIG);
+
+    /* Acknowledge, so that the server switches to the extended protocol. */
+
+    if (fsrv_tmout) ck_write(fsrv_ctl_fd, &status, 4, "fork server pipe");
+
+    OKF("All right - fork server is up%s.",
+        fsrv_tmout ? " (enforcing exec timeouts)" : "");
     return;
+
   }
 
   if (child_timed_out)
@@ -2390,11 +2461,14 @@ static u8 run_target(char** argv, u32 timeout) {
   } else {
 
     s32 res;
+    u32 msg[2] = { prev_timed_out, timeout };
 
     /* In non-dumb mode, we have the fork server up and running, so simply
-       tell it to have at it, and then read back PID. */
+       tell it to have at it, and then read back PID. Fork servers that
+       enforce timeouts also get the deadline for this run. */
 
-    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
+    if ((res = write(fsrv_ctl_fd, msg, fsrv_tmout ? 8 : 4)) !=
+        (fsrv_tmout ? 8 : 4)) {
 
       if (stop_soon) return 0;
       RPFATAL(res, "Unable to request new process from fork server (OOM?)");
@@ -2412,42 +2486,95 @@ static u8 run_target(char** argv, u32 timeout) {
 
   }
 
-  /* Configure timeout, as requested by user, then wait for child to terminate. */
+  if (fsrv_tmout && !(dumb_mode == 1 || no_forkserver)) {
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+    /* The fork server kills the child once the timeout expires, so all we
+       need to do is poll the status pipe. We only step in ourselves if the
+       fork server doesn't report back within a grace period. */
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    struct pollfd pfd = { .fd = fsrv_st_fd, .events = POLLIN };
+    u64 start_ms = get_cur_time(), cur_ms;
+    u32 msg[2];
+    s32 res;
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+    while (1) {
 
-  if (dumb_mode == 1 || no_forkserver) {
+      s32 left = (s32)(timeout + FORKSRV_TMOUT_GRACE) -
+                 (s32)(get_cur_time() - start_ms);
 
-    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+      if (left <= 0) {
 
-  } else {
+        child_timed_out = 1;
+        if (child_pid > 0) kill(child_pid, SIGKILL);
+        break;
 
-    s32 res;
+      }
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+      res = poll(&pfd, 1, left);
+
+      if (res > 0) break;
+      if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+      if (stop_soon) return 0;
+
+    }
+
+    if ((res = read(fsrv_st_fd, msg, 8)) != 8) {
 
       if (stop_soon) return 0;
       RPFATAL(res, "Unable to communicate with fork server (OOM?)");
 
     }
 
-  }
+    status = msg[0];
+    if (msg[1]) child_timed_out = 1;
 
-  if (!WIFSTOPPED(status)) child_pid = 0;
+    cur_ms  = get_cur_time();
+    exec_ms = MIN(cur_ms - start_ms, timeout);
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms = (u64) timeout - (it.it_value.tv_sec * 1000 +
-                             it.it_value.tv_usec / 1000);
+    if (!WIFSTOPPED(status)) child_pid = 0;
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  } else {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    /* Configure timeout, as requested by user, then wait for child to
+       terminate. */
+
+    it.it_value.tv_sec = (timeout / 1000);
+    it.it_value.tv_usec = (timeout % 1000) * 1000;
+
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    /* The SIGALRM handler simply kills the child_pid and sets
+       child_timed_out. */
+
+    if (dumb_mode == 1 || no_forkserver) {
+
+      if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+    } else {
+
+      s32 res;
+
+      if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+
+        if (stop_soon) return 0;
+        RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+      }
+
+    }
+
+    if (!WIFSTOPPED(status)) child_pid = 0;
+
+    getitimer(ITIMER_REAL, &it);
+    exec_ms = (u64) timeout - (it.it_value.tv_sec * 1000 +
+                               it.it_value.tv_usec / 1000);
+
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+
+    setitimer(ITIMER_REAL, &it, NULL);
+
+  }
 
   total_execs++;
 
@@ -2467,6 +2594,8 @@ static u8 run_target(char** argv, u32 timeout) {
 
   prev_timed_out = child_timed_out;
 
+  harvest_rezzan_dict();
+
   /* Report outcome to caller. */
 
   if (WIFSIGNALED(status) && !stop_soon) {
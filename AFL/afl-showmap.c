@@ -26,6 +26,11 @@
 
    Exit code is 2 if the target program crashes; 1 if it times out or
    there is a problem executing it; or 0 if execution is successful.
+
+   With -i, all inputs in a directory (or listed in a file, one path per
+   line) are run through a single fork server, and one trace per input is
+   written to the output directory. This spares afl-cmin a full exec and
+   runtime startup for every file.
 */
 
 #define AFL_MAIN
@@ -46,6 +51,8 @@
 #include <signal.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -54,11 +61,15 @@
 #include <sys/types.h>
 #include <sys/resource.h>
 
-static s32 child_pid;                 /* PID of the tested program         */
+static s32 child_pid,                 /* PID of the tested program         */
+           forksrv_pid,               /* PID of the fork server            */
+           fsrv_ctl_fd,               /* Fork server control pipe (write)  */
+           fsrv_st_fd;                /* Fork server status pipe (read)    */
 
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
-static u8 *out_file,                  /* Trace output file                 */
+static u8 *in_path,                   /* Batch input directory or list     */
+          *out_file,                  /* Trace output file (or directory)  */
           *doc_path,                  /* Path to docs                      */
           *target_path,               /* Path to target binary             */
           *at_file;                   /* Substitution string for @@        */
@@ -69,11 +80,17 @@ static u64 mem_limit = MEM_LIMIT;     /* Memory limit (MB)                 */
 
 static s32 shm_id;                    /* ID of the SHM region              */
 
+static s32 prog_in_fd = -1,           /* Batch mode input file fd          */
+           dev_null_fd = -1;          /* Persistent fd for /dev/null       */
+
 static u8  quiet_mode,                /* Hide non-essential messages?      */
            edges_only,                /* Ignore hit counts?                */
            cmin_mode,                 /* Generate output in afl-cmin mode? */
            binary_mode,               /* Write output as a binary map      */
-           keep_cores;                /* Allow coredumps?                  */
+           keep_cores,                /* Allow coredumps?                  */
+           fsrv_tmout,                /* Fork server enforces timeouts?    */
+           batch_stdin,               /* Batch inputs go to stdin?         */
+           prev_timed_out;            /* Previous run timed out?           */
 
 static volatile u8
            stop_soon,                 /* Ctrl-C pressed?                   */
@@ -167,9 +184,12 @@ static void setup_shm(void) {
 
 }
 
-/* Write results. */
+/* Write results. In batch mode, traces are written in a compact binary
+   format unless -Z or -b is given: one little-endian u32 per tuple hit,
+   holding the map index in the upper 24 bits and the count class bit (as
+   in afl-fuzz) in the lower 8. */
 
-static u32 write_results(void) {
+static u32 write_results(u8* out_file) {
 
   s32 fd;
   u32 i, ret = 0;
@@ -204,6 +224,16 @@ static u32 write_results(void) {
     ck_write(fd, trace_bits, MAP_SIZE, out_file);
     close(fd);
 
+  } else if (in_path && !cmin_mode) {
+
+    static u32 tuples[MAP_SIZE];
+
+    for (i = 0; i < MAP_SIZE; i++)
+      if (trace_bits[i]) tuples[ret++] = (i << 8) | trace_bits[i];
+
+    ck_write(fd, tuples, ret * sizeof(u32), out_file);
+    close(fd);
+
   } else {
 
     FILE* f = fdopen(fd, "w");
@@ -360,6 +390,367 @@ static void run_target(char** argv) {
 }
 
 
+/* Get unix time in milliseconds. */
+
+static u64 get_cur_time(void) {
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+}
+
+
+/* Clean up the fork server and the batch input file (atexit handler). */
+
+static void remove_batch(void) {
+
+  if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  if (batch_stdin) unlink(at_file); /* Ignore errors */
+
+}
+
+
+/* Set up the batch input file. Targets that take @@ or -A read it by name;
+   others get it on stdin, which the fork server inherits. */
+
+static void setup_batch(void) {
+
+  struct stat st;
+
+  if (stat(out_file, &st) || !S_ISDIR(st.st_mode))
+    FATAL("With -i, -o must be an existing directory");
+
+  if (!at_file) {
+
+    at_file = alloc_printf("%s/.cur_input", out_file);
+    batch_stdin = 1;
+
+  }
+
+  prog_in_fd = open(at_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (prog_in_fd < 0) PFATAL("Unable to create '%s'", at_file);
+
+  dev_null_fd = open("/dev/null", O_RDWR);
+  if (dev_null_fd < 0) PFATAL("Unable to open /dev/null");
+
+  atexit(remove_batch);
+
+}
+
+
+/* Spin up the fork server. Both the classic protocol and the one where the
+   server enforces the timeout itself (FORKSRV_TMOUT_SIG) are understood. */
+
+static void init_forkserver(char** argv) {
+
+  int st_pipe[2], ctl_pipe[2];
+  struct pollfd pfd;
+  int status;
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+
+  forksrv_pid = fork();
+
+  if (forksrv_pid < 0) PFATAL("fork() failed");
+
+  if (!forksrv_pid) {
+
+    struct rlimit r;
+
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+
+    }
+
+    if (mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+    }
+
+    if (!keep_cores) r.rlim_max = r.rlim_cur = 0;
+    else r.rlim_max = r.rlim_cur = RLIM_INFINITY;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    setsid();
+
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+
+    if (batch_stdin) dup2(prog_in_fd, 0);
+    else dup2(dev_null_fd, 0);
+
+    close(prog_in_fd);
+    close(dev_null_fd);
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+
+    execv(target_path, argv);
+
+    *(u32*)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
+
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd  = st_pipe[0];
+
+  /* Wait for the fork server to come up, but don't wait too long. */
+
+  pfd.fd     = fsrv_st_fd;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, (exec_tmout ? exec_tmout : EXEC_TIMEOUT) *
+           FORK_WAIT_MULT) > 0 && read(fsrv_st_fd, &status, 4) == 4) {
+
+    fsrv_tmout = (status == FORKSRV_TMOUT_SIG);
+
+    /* Acknowledge, so that the server switches to the extended protocol. */
+
+    if (fsrv_tmout) ck_write(fsrv_ctl_fd, &status, 4, "fork server pipe");
+
+    return;
+
+  }
+
+  kill(forksrv_pid, SIGKILL);
+
+  if (waitpid(forksrv_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  forksrv_pid = 0;
+
+  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute '%s'", argv[0]);
+
+  FATAL("Fork server handshake failed (is the target instrumented?)");
+
+}
+
+
+/* Execute target application through the fork server. Without -t, runs are
+   not time-limited. */
+
+static void run_target_fsrv(void) {
+
+  struct pollfd pfd = { .fd = fsrv_st_fd, .events = POLLIN };
+  u32 msg[2] = { prev_timed_out, exec_tmout ? exec_tmout : 0xffffffff };
+  u64 start_ms;
+  s32 res;
+
+  memset(trace_bits, 0, MAP_SIZE);
+  child_timed_out = child_crashed = 0;
+
+  MEM_BARRIER();
+
+  if ((res = write(fsrv_ctl_fd, msg, fsrv_tmout ? 8 : 4)) !=
+      (fsrv_tmout ? 8 : 4))
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+  if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4)
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+  if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+
+  /* Wait for the status message. Fork servers that enforce the timeout get
+     a grace period; otherwise, we kill the child ourselves. */
+
+  start_ms = get_cur_time();
+
+  while (1) {
+
+    s32 left = -1;
+
+    if (exec_tmout) {
+
+      left = (s32)(exec_tmout + (fsrv_tmout ? FORKSRV_TMOUT_GRACE : 0)) -
+             (s32)(get_cur_time() - start_ms);
+
+      if (left <= 0) {
+
+        child_timed_out = 1;
+        kill(child_pid, SIGKILL);
+        break;
+
+      }
+
+    }
+
+    res = poll(&pfd, 1, left);
+
+    if (res > 0) break;
+    if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+    if (stop_soon) exit(1);
+
+  }
+
+  if (fsrv_tmout) {
+
+    if ((res = read(fsrv_st_fd, msg, 8)) != 8)
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+    if (msg[1]) child_timed_out = 1;
+
+  } else if ((res = read(fsrv_st_fd, &msg[0], 4)) != 4)
+    RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+  child_pid = 0;
+  prev_timed_out = child_timed_out;
+
+  MEM_BARRIER();
+
+  classify_counts(trace_bits, (binary_mode || !cmin_mode) ?
+                  count_class_binary : count_class_human);
+
+  if (!child_timed_out && !stop_soon && WIFSIGNALED(msg[0]))
+    child_crashed = 1;
+
+}
+
+
+/* Run one batch input and write its trace to the output directory. */
+
+static void run_batch_one(u8* fname, u32* crashes, u32* hangs) {
+
+  struct stat st;
+  u8 *mem, *base, *trace_file;
+  s32 fd;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  mem = ck_alloc_nozero(st.st_size + 1);
+  ck_read(fd, mem, st.st_size, fname);
+  close(fd);
+
+  lseek(prog_in_fd, 0, SEEK_SET);
+  ck_write(prog_in_fd, mem, st.st_size, at_file);
+  if (ftruncate(prog_in_fd, st.st_size)) PFATAL("ftruncate() failed");
+  lseek(prog_in_fd, 0, SEEK_SET);
+
+  ck_free(mem);
+
+  run_target_fsrv();
+
+  if (child_crashed) (*crashes)++;
+  if (child_timed_out) (*hangs)++;
+
+  base = strrchr(fname, '/');
+  base = base ? base + 1 : fname;
+
+  trace_file = alloc_printf("%s/%s", out_file, base);
+  write_results(trace_file);
+  ck_free(trace_file);
+
+}
+
+
+/* Run all inputs in in_path (a directory, or a file listing one path per
+   line) through a single fork server. */
+
+static void run_batch(char** argv) {
+
+  struct stat st;
+  u32 total = 0, crashes = 0, hangs = 0;
+
+  if (stat(in_path, &st)) PFATAL("Unable to access '%s'", in_path);
+
+  init_forkserver(argv);
+
+  if (!quiet_mode)
+    OKF("Fork server is up%s.",
+        fsrv_tmout ? " (enforcing exec timeouts)" : "");
+
+  if (S_ISDIR(st.st_mode)) {
+
+    struct dirent** nl;
+    s32 nl_cnt, i;
+
+    nl_cnt = scandir(in_path, &nl, NULL, alphasort);
+    if (nl_cnt < 0) PFATAL("Unable to open '%s'", in_path);
+
+    for (i = 0; i < nl_cnt; i++) {
+
+      u8* fn = alloc_printf("%s/%s", in_path, nl[i]->d_name);
+
+      free(nl[i]); /* not tracked */
+
+      if (!stop_soon && !lstat(fn, &st) && S_ISREG(st.st_mode)) {
+
+        run_batch_one(fn, &crashes, &hangs);
+        total++;
+
+      }
+
+      ck_free(fn);
+
+    }
+
+    free(nl); /* not tracked */
+
+  } else {
+
+    FILE* f = fopen(in_path, "r");
+    u8 line[PATH_MAX + 2];
+
+    if (!f) PFATAL("Unable to open '%s'", in_path);
+
+    while (!stop_soon && fgets(line, sizeof(line), f)) {
+
+      u32 len = strlen(line);
+
+      while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = 0;
+
+      if (!len) continue;
+
+      run_batch_one(line, &crashes, &hangs);
+      total++;
+
+    }
+
+    fclose(f);
+
+  }
+
+  if (stop_soon) FATAL("Interrupted by user");
+
+  if (!quiet_mode)
+    OKF("Processed %u inputs (%u crashes, %u timeouts), traces in '%s'.",
+        total, crashes, hangs, out_file);
+
+}
+
+
 /* Handle Ctrl-C and the like. */
 
 static void handle_stop_sig(int sig) {
@@ -485,6 +876,12 @@ static void usage(u8* argv0) {
 
        "  -o file       - file to write the trace data to\n\n"
 
+       "Batch mode:\n\n"
+
+       "  -i path       - run every input in this directory (or listed in\n"
+       "                  this file) through one fork server; -o is then\n"
+       "                  the directory for the per-input traces\n\n"
+
        "Execution control settings:\n\n"
 
        "  -t msec       - timeout for each run (none)\n"
@@ -635,10 +1032,16 @@ int main(int argc, char** argv) {
 
   doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
 
-  while ((opt = getopt(argc,argv,"+o:m:t:A:eqZQbcV")) > 0)
+  while ((opt = getopt(argc,argv,"+i:o:m:t:A:eqZQbcV")) > 0)
 
     switch (opt) {
 
+      case 'i':
+
+        if (in_path) FATAL("Multiple -i options not supported");
+        in_path = optarg;
+        break;
+
       case 'o':
 
         if (out_file) FATAL("Multiple -o options not supported");
@@ -766,6 +1169,8 @@ int main(int argc, char** argv) {
 
   find_binary(argv[optind]);
 
+  if (in_path) setup_batch();
+
   if (!quiet_mode) {
     show_banner();
     ACTF("Executing '%s'...\n", target_path);
@@ -778,9 +1183,16 @@ int main(int argc, char** argv) {
   else
     use_argv = argv + optind;
 
+  if (in_path) {
+
+    run_batch(use_argv);
+    exit(0);
+
+  }
+
   run_target(use_argv);
 
-  tcnt = write_results();
+  tcnt = write_results(out_file);
 
   if (!quiet_mode) {
 
@@ -0,0 +1,899 @@
+/*
+  Copyright 2013 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - crash triage utility
+   -----------------------------------------
+
+   Replays every file in the crashes/ and hangs/ directories of an afl-fuzz
+   output directory (or every file in a plain directory) through a single
+   fork server, and groups the results into buckets.
+
+   For targets built against the ReZZan runtime, the runtime fills in a
+   small shared fault record before the target dies: the fault class (e.g.
+   "bad or double-free detected"), the faulting site as an offset into the
+   target binary, and a hash of the innermost return addresses found on the
+   stack. Crashes are bucketed by (class, site, stack hash); for other
+   targets, the terminating signal is all we have to go by.
+
+   The summary table is written to the file given with -o, most frequent
+   bucket first.
+*/
+
+#define AFL_MAIN
+#include "android-ashmem.h"
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* Fault record filled in by the ReZZan runtime. The layout must match
+   `struct Triage' in rezzan_runtime.c. */
+
+struct rezzan_triage {
+
+  u32 valid;                          /* Record filled in?                 */
+  u32 signal;                         /* Signal that killed the target     */
+  u64 site;                           /* Faulting site (image offset)      */
+  u64 stack_hash;                     /* Hash of innermost call sites      */
+  u8  what[64];                       /* Fault class                       */
+
+};
+
+/* One bucket of the summary. */
+
+struct bucket {
+
+  u8* what;                           /* Fault class                       */
+  u64 site;                           /* Faulting site (image offset)      */
+  u64 stack_hash;                     /* Hash of innermost call sites      */
+  u32 count;                          /* Number of inputs in the bucket    */
+  u8* example;                        /* First input seen                  */
+
+};
+
+static s32 child_pid,                 /* PID of the tested program         */
+           forksrv_pid,               /* PID of the fork server            */
+           fsrv_ctl_fd,               /* Fork server control pipe (write)  */
+           fsrv_st_fd;                /* Fork server status pipe (read)    */
+
+static u8* trace_bits;                /* SHM with instrumentation bitmap   */
+
+static struct rezzan_triage* triage;  /* SHM with the fault record         */
+
+static u8 *in_dir,                    /* Findings or input directory       */
+          *out_file,                  /* Summary output file               */
+          *prog_in,                   /* Targeted program input file       */
+          *doc_path,                  /* Path to docs                      */
+          *target_path;               /* Path to target binary             */
+
+static s32 prog_in_fd,                /* Persistent fd for prog_in         */
+           dev_null_fd = -1;          /* Persistent fd for /dev/null       */
+
+static u32 exec_tmout = EXEC_TIMEOUT; /* Exec timeout (ms)                 */
+
+static u64 mem_limit = MEM_LIMIT;     /* Memory limit (MB)                 */
+
+static s32 shm_id = -1,               /* ID of the trace SHM region        */
+           triage_shm_id = -1;        /* ID of the fault record SHM region */
+
+static u8  use_stdin = 1,             /* Use stdin for program input?      */
+           fsrv_tmout,                /* Fork server enforces timeouts?    */
+           prev_timed_out;            /* Previous run timed out?           */
+
+static struct bucket* buckets;        /* Summary buckets                   */
+static u32 bucket_cnt;                /* Number of buckets                 */
+
+static u32 total_runs,                /* Inputs replayed                   */
+           total_crashes,             /* ...of which crashed               */
+           total_hangs;               /* ...of which hung                  */
+
+static volatile u8
+           stop_soon,                 /* Ctrl-C pressed?                   */
+           child_timed_out;           /* Child timed out?                  */
+
+
+/* Get unix time in milliseconds. */
+
+static u64 get_cur_time(void) {
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+}
+
+
+/* Get rid of shared memory and temp files (atexit handler). */
+
+static void at_exit_handler(void) {
+
+  if (shm_id >= 0) shmctl(shm_id, IPC_RMID, NULL);
+  if (triage_shm_id >= 0) shmctl(triage_shm_id, IPC_RMID, NULL);
+
+  if (prog_in) unlink(prog_in); /* Ignore errors */
+
+  if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+
+}
+
+
+/* Configure shared memory. The trace map is only there to keep the
+   instrumentation happy; the fault record is what we are after. */
+
+static void setup_shm(void) {
+
+  u8* shm_str;
+
+  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id < 0) PFATAL("shmget() failed");
+
+  triage_shm_id = shmget(IPC_PRIVATE, sizeof(struct rezzan_triage),
+                         IPC_CREAT | IPC_EXCL | 0600);
+
+  if (triage_shm_id < 0) PFATAL("shmget() failed");
+
+  atexit(at_exit_handler);
+
+  shm_str = alloc_printf("%d", shm_id);
+  setenv(SHM_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  shm_str = alloc_printf("%d", triage_shm_id);
+  setenv(REZZAN_TRIAGE_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  trace_bits = shmat(shm_id, NULL, 0);
+  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
+
+  triage = shmat(triage_shm_id, NULL, 0);
+  if (triage == (void *)-1) PFATAL("shmat() failed");
+
+}
+
+
+/* Set up the input file. For @@ targets, the path is substituted into argv;
+   otherwise, the fork server's stdin is a dup of prog_in_fd. */
+
+static void setup_prog_in(void) {
+
+  u8* use_dir = ".";
+
+  if (access(use_dir, R_OK | W_OK | X_OK)) {
+
+    use_dir = getenv("TMPDIR");
+    if (!use_dir) use_dir = "/tmp";
+
+  }
+
+  prog_in = alloc_printf("%s/.afl-triage-temp-%u", use_dir, getpid());
+
+  unlink(prog_in); /* Ignore errors */
+
+  prog_in_fd = open(prog_in, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+  if (prog_in_fd < 0) PFATAL("Unable to create '%s'", prog_in);
+
+  dev_null_fd = open("/dev/null", O_RDWR);
+  if (dev_null_fd < 0) PFATAL("Unable to open /dev/null");
+
+}
+
+
+/* Write modified data to the input file. */
+
+static void write_to_testcase(void* mem, u32 len) {
+
+  lseek(prog_in_fd, 0, SEEK_SET);
+
+  ck_write(prog_in_fd, mem, len, prog_in);
+
+  if (ftruncate(prog_in_fd, len)) PFATAL("ftruncate() failed");
+
+  lseek(prog_in_fd, 0, SEEK_SET);
+
+}
+
+
+/* Spin up the fork server. Both the classic protocol and the one where the
+   server enforces the timeout itself (FORKSRV_TMOUT_SIG) are understood. */
+
+static void init_forkserver(char** argv) {
+
+  int st_pipe[2], ctl_pipe[2];
+  struct pollfd pfd;
+  int status;
+  s32 rlen;
+
+  ACTF("Spinning up the fork server...");
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+
+  forksrv_pid = fork();
+
+  if (forksrv_pid < 0) PFATAL("fork() failed");
+
+  if (!forksrv_pid) {
+
+    struct rlimit r;
+
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+
+    }
+
+    if (mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+    }
+
+    r.rlim_max = r.rlim_cur = 0;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    setsid();
+
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+
+    if (use_stdin) dup2(prog_in_fd, 0);
+    else dup2(dev_null_fd, 0);
+
+    close(prog_in_fd);
+    close(dev_null_fd);
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1", 0);
+
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                           "symbolize=0:"
+                           "abort_on_error=1:"
+                           "allocator_may_return_null=1:"
+                           "msan_track_origins=0", 0);
+
+    execv(target_path, argv);
+
+    *(u32*)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
+
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd  = st_pipe[0];
+
+  /* Wait for the fork server to come up, but don't wait too long. */
+
+  pfd.fd     = fsrv_st_fd;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, exec_tmout * FORK_WAIT_MULT) > 0 &&
+      (rlen = read(fsrv_st_fd, &status, 4)) == 4) {
+
+    fsrv_tmout = (status == FORKSRV_TMOUT_SIG);
+
+    /* Acknowledge, so that the server switches to the extended protocol. */
+
+    if (fsrv_tmout) ck_write(fsrv_ctl_fd, &status, 4, "fork server pipe");
+
+    OKF("All right - fork server is up%s.",
+        fsrv_tmout ? " (enforcing exec timeouts)" : "");
+    return;
+
+  }
+
+  kill(forksrv_pid, SIGKILL);
+
+  if (waitpid(forksrv_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  forksrv_pid = 0;
+
+  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", argv[0]);
+
+  FATAL("Fork server handshake failed (is the target instrumented?)");
+
+}
+
+
+/* Execute target application once, return waitpid(2) status. */
+
+static int run_target(void) {
+
+  struct pollfd pfd = { .fd = fsrv_st_fd, .events = POLLIN };
+  u32 msg[2] = { prev_timed_out, exec_tmout };
+  u64 start_ms;
+  s32 res;
+
+  memset(triage, 0, sizeof(struct rezzan_triage));
+  child_timed_out = 0;
+
+  MEM_BARRIER();
+
+  if ((res = write(fsrv_ctl_fd, msg, fsrv_tmout ? 8 : 4)) !=
+      (fsrv_tmout ? 8 : 4))
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+  if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4)
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+  if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+
+  /* Wait for the status message. Fork servers that enforce the timeout get
+     a grace period; otherwise, we kill the child ourselves. */
+
+  start_ms = get_cur_time();
+
+  while (1) {
+
+    s32 left = (s32)(exec_tmout + (fsrv_tmout ? FORKSRV_TMOUT_GRACE : 0)) -
+               (s32)(get_cur_time() - start_ms);
+
+    if (left <= 0) {
+
+      child_timed_out = 1;
+      kill(child_pid, SIGKILL);
+      break;
+
+    }
+
+    res = poll(&pfd, 1, left);
+
+    if (res > 0) break;
+    if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+    if (stop_soon) exit(1);
+
+  }
+
+  if (fsrv_tmout) {
+
+    if ((res = read(fsrv_st_fd, msg, 8)) != 8)
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+    if (msg[1]) child_timed_out = 1;
+
+  } else if ((res = read(fsrv_st_fd, &msg[0], 4)) != 4)
+    RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+  child_pid = 0;
+  prev_timed_out = child_timed_out;
+
+  MEM_BARRIER();
+
+  return (int)msg[0];
+
+}
+
+
+/* Add the outcome of one run to the summary. */
+
+static void add_to_bucket(u8* what, u64 site, u64 stack_hash, u8* fname) {
+
+  u32 i;
+
+  for (i = 0; i < bucket_cnt; i++)
+    if (buckets[i].site == site && buckets[i].stack_hash == stack_hash &&
+        !strcmp(buckets[i].what, what)) break;
+
+  if (i == bucket_cnt) {
+
+    buckets = ck_realloc(buckets, (bucket_cnt + 1) * sizeof(struct bucket));
+
+    buckets[i].what       = ck_strdup(what);
+    buckets[i].site       = site;
+    buckets[i].stack_hash = stack_hash;
+    buckets[i].example    = ck_strdup(fname);
+    bucket_cnt++;
+
+  }
+
+  buckets[i].count++;
+
+}
+
+
+/* Replay a single input. */
+
+static void triage_one(u8* fname, u8* label) {
+
+  struct stat st;
+  s32 fd, status;
+  u8* mem;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  mem = ck_alloc_nozero(st.st_size + 1);
+  ck_read(fd, mem, st.st_size, fname);
+  close(fd);
+
+  write_to_testcase(mem, st.st_size);
+  ck_free(mem);
+
+  status = run_target();
+  total_runs++;
+
+  if (child_timed_out) {
+
+    total_hangs++;
+    add_to_bucket("hang", 0, 0, label);
+
+  } else if (WIFSIGNALED(status)) {
+
+    total_crashes++;
+
+    if (triage->valid) {
+
+      triage->what[sizeof(triage->what) - 1] = 0;
+      add_to_bucket(triage->what, triage->site, triage->stack_hash, label);
+
+    } else {
+
+      u8* what = alloc_printf("signal %u", WTERMSIG(status));
+      add_to_bucket(what, 0, 0, label);
+      ck_free(what);
+
+    }
+
+  } else add_to_bucket("no crash", 0, 0, label);
+
+}
+
+
+/* Replay all regular files in a directory, in name order. */
+
+static void triage_dir(u8* dir, u8* prefix) {
+
+  struct dirent** nl;
+  s32 nl_cnt, i;
+
+  nl_cnt = scandir(dir, &nl, NULL, alphasort);
+  if (nl_cnt < 0) PFATAL("Unable to open '%s'", dir);
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    struct stat st;
+    u8* fn    = alloc_printf("%s/%s", dir, nl[i]->d_name);
+    u8* label = prefix ? alloc_printf("%s/%s", prefix, nl[i]->d_name)
+                       : ck_strdup(nl[i]->d_name);
+    u8  skip  = !strcmp(nl[i]->d_name, "README.txt");
+
+    free(nl[i]); /* not tracked */
+
+    if (!stop_soon && !skip && !lstat(fn, &st) && S_ISREG(st.st_mode) &&
+        st.st_size) {
+
+      triage_one(fn, label);
+
+      if (!(total_runs % 100))
+        ACTF("Replayed %u inputs, %u buckets so far...", total_runs,
+             bucket_cnt);
+
+    }
+
+    ck_free(fn);
+    ck_free(label);
+
+  }
+
+  free(nl); /* not tracked */
+
+}
+
+
+/* Compare buckets, most frequent first. */
+
+static int compare_buckets(const void* a, const void* b) {
+
+  const struct bucket *ba = a, *bb = b;
+
+  if (ba->count != bb->count) return ba->count < bb->count ? 1 : -1;
+  return strcmp(ba->what, bb->what);
+
+}
+
+
+/* Write the summary table. */
+
+static void write_results(void) {
+
+  FILE* f;
+  u32 i;
+
+  qsort(buckets, bucket_cnt, sizeof(struct bucket), compare_buckets);
+
+  if (!strcmp(out_file, "-")) f = fdopen(dup(1), "w");
+  else {
+
+    unlink(out_file); /* Ignore errors */
+    f = fopen(out_file, "w");
+
+  }
+
+  if (!f) PFATAL("Unable to create '%s'", out_file);
+
+  fprintf(f, "# %-6s %-40s %-18s %-18s %s\n", "count", "class", "site",
+          "stack_hash", "example");
+
+  for (i = 0; i < bucket_cnt; i++)
+    fprintf(f, "  %-6u %-40s 0x%016llx 0x%016llx %s\n", buckets[i].count,
+            buckets[i].what, buckets[i].site, buckets[i].stack_hash,
+            buckets[i].example);
+
+  fclose(f);
+
+}
+
+
+/* Handle Ctrl-C and the like. */
+
+static void handle_stop_sig(int sig) {
+
+  stop_soon = 1;
+
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+
+}
+
+
+/* Setup signal handlers, duh. */
+
+static void setup_signal_handlers(void) {
+
+  struct sigaction sa;
+
+  sa.sa_handler   = NULL;
+  sa.sa_flags     = 0;
+  sa.sa_sigaction = NULL;
+
+  sigemptyset(&sa.sa_mask);
+
+  /* Various ways of saying "stop". */
+
+  sa.sa_handler = handle_stop_sig;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  /* Things we don't care about. */
+
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+}
+
+
+/* Detect @@ in args. */
+
+static void detect_file_args(char** argv) {
+
+  u32 i = 0;
+  u8* cwd = getcwd(NULL, 0);
+
+  if (!cwd) PFATAL("getcwd() failed");
+
+  while (argv[i]) {
+
+    u8* aa_loc = strstr(argv[i], "@@");
+
+    if (aa_loc) {
+
+      u8 *aa_subst, *n_arg;
+
+      /* Be sure that we're always using fully-qualified paths. */
+
+      if (prog_in[0] == '/') aa_subst = prog_in;
+      else aa_subst = alloc_printf("%s/%s", cwd, prog_in);
+
+      /* Construct a replacement argv value. */
+
+      *aa_loc = 0;
+      n_arg = alloc_printf("%s%s%s", argv[i], aa_subst, aa_loc + 2);
+      argv[i] = n_arg;
+      *aa_loc = '@';
+
+      if (prog_in[0] != '/') ck_free(aa_subst);
+
+      use_stdin = 0;
+
+    }
+
+    i++;
+
+  }
+
+  free(cwd); /* not tracked */
+
+}
+
+
+/* Show banner. */
+
+static void show_banner(void) {
+
+  SAYF(cCYA "afl-triage " cBRI VERSION cRST "\n");
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  show_banner();
+
+  SAYF("\n%s [ options ] -- /path/to/target_app [ ... ]\n\n"
+
+       "Required parameters:\n\n"
+
+       "  -i dir        - afl-fuzz output directory (crashes/ and hangs/ are\n"
+       "                  replayed), or any directory with inputs\n"
+       "  -o file       - file to write the summary to ('-' for stdout)\n\n"
+
+       "Execution control settings:\n\n"
+
+       "  -t msec       - timeout for each run (%u ms)\n"
+       "  -m megs       - memory limit for child process (%u MB)\n\n"
+
+       "Other settings:\n\n"
+
+       "  -V            - show version number and exit\n\n"
+
+       "This tool buckets crashing inputs by ReZZan fault class, site and call\n"
+       "stack. For additional help, consult %s/README.\n\n" cRST,
+
+       argv0, EXEC_TIMEOUT, MEM_LIMIT, doc_path);
+
+  exit(1);
+
+}
+
+
+/* Find binary. */
+
+static void find_binary(u8* fname) {
+
+  u8* env_path = 0;
+  struct stat st;
+
+  if (strchr(fname, '/') || !(env_path = getenv("PATH"))) {
+
+    target_path = ck_strdup(fname);
+
+    if (stat(target_path, &st) || !S_ISREG(st.st_mode) ||
+        !(st.st_mode & 0111) || st.st_size < 4)
+      FATAL("Program '%s' not found or not executable", fname);
+
+  } else {
+
+    while (env_path) {
+
+      u8 *cur_elem, *delim = strchr(env_path, ':');
+
+      if (delim) {
+
+        cur_elem = ck_alloc(delim - env_path + 1);
+        memcpy(cur_elem, env_path, delim - env_path);
+        delim++;
+
+      } else cur_elem = ck_strdup(env_path);
+
+      env_path = delim;
+
+      if (cur_elem[0])
+        target_path = alloc_printf("%s/%s", cur_elem, fname);
+      else
+        target_path = ck_strdup(fname);
+
+      ck_free(cur_elem);
+
+      if (!stat(target_path, &st) && S_ISREG(st.st_mode) &&
+          (st.st_mode & 0111) && st.st_size >= 4) break;
+
+      ck_free(target_path);
+      target_path = 0;
+
+    }
+
+    if (!target_path) FATAL("Program '%s' not found or not executable", fname);
+
+  }
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt;
+  u8  mem_limit_given = 0, timeout_given = 0, found = 0;
+  struct stat st;
+  u8* sub;
+
+  doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
+
+  while ((opt = getopt(argc,argv,"+i:o:m:t:V")) > 0)
+
+    switch (opt) {
+
+      case 'i':
+
+        if (in_dir) FATAL("Multiple -i options not supported");
+        in_dir = optarg;
+        break;
+
+      case 'o':
+
+        if (out_file) FATAL("Multiple -o options not supported");
+        out_file = optarg;
+        break;
+
+      case 'm': {
+
+          u8 suffix = 'M';
+
+          if (mem_limit_given) FATAL("Multiple -m options not supported");
+          mem_limit_given = 1;
+
+          if (!strcmp(optarg, "none")) {
+
+            mem_limit = 0;
+            break;
+
+          }
+
+          if (sscanf(optarg, "%llu%c", &mem_limit, &suffix) < 1 ||
+              optarg[0] == '-') FATAL("Bad syntax used for -m");
+
+          switch (suffix) {
+
+            case 'T': mem_limit *= 1024 * 1024; break;
+            case 'G': mem_limit *= 1024; break;
+            case 'k': mem_limit /= 1024; break;
+            case 'M': break;
+
+            default:  FATAL("Unsupported suffix or bad syntax for -m");
+
+          }
+
+          if (mem_limit < 5) FATAL("Dangerously low value of -m");
+
+        }
+
+        break;
+
+      case 't':
+
+        if (timeout_given) FATAL("Multiple -t options not supported");
+        timeout_given = 1;
+
+        exec_tmout = atoi(optarg);
+
+        if (exec_tmout < 10 || optarg[0] == '-')
+          FATAL("Dangerously low value of -t");
+
+        break;
+
+      case 'V':
+
+        show_banner();
+        exit(0);
+
+      default:
+
+        usage(argv[0]);
+
+    }
+
+  if (optind == argc || !in_dir || !out_file) usage(argv[0]);
+
+  setup_shm();
+  setup_signal_handlers();
+  setup_prog_in();
+
+  find_binary(argv[optind]);
+  detect_file_args(argv + optind);
+
+  init_forkserver(argv + optind);
+
+  /* Replay crashes/ and hangs/ of a findings directory, or else the
+     directory itself. */
+
+  sub = alloc_printf("%s/crashes", in_dir);
+
+  if (!stat(sub, &st) && S_ISDIR(st.st_mode)) {
+    triage_dir(sub, "crashes");
+    found = 1;
+  }
+
+  ck_free(sub);
+
+  sub = alloc_printf("%s/hangs", in_dir);
+
+  if (!stat(sub, &st) && S_ISDIR(st.st_mode)) {
+    triage_dir(sub, "hangs");
+    found = 1;
+  }
+
+  ck_free(sub);
+
+  if (!found) triage_dir(in_dir, NULL);
+
+  if (stop_soon) FATAL("Interrupted by user");
+
+  if (!total_runs) FATAL("No inputs found in '%s'", in_dir);
+
+  write_results();
+
+  OKF("Replayed %u inputs: %u crashes, %u hangs, %u buckets.", total_runs,
+      total_crashes, total_hangs, bucket_cnt);
+
+  exit(0);
+
+}
@@ -184,6 +184,20 @@
 #define USE_AUTO_EXTRAS     50
 #define MAX_AUTO_EXTRAS     (USE_AUTO_EXTRAS * 10)
 
+/* Comparison tokens captured by the ReZZan runtime's strcmp() / memcmp()
+   interceptors (AFL_REZZAN_DICT): number of slots in the shared buffer that
+   afl-fuzz harvests after every run, and the size (in bits) of the filter
+   used to record each distinct token only once. Keep in sync with
+   rezzan_runtime.c. */
+
+#define REZZAN_DICT_MAX     512
+#define REZZAN_DICT_SEEN    (1 << 16)
+
+/* Static ReZZan runtime that afl-clang-fast links into AFL_CHECK_REZZAN
+   builds, where installed (see install.sh). */
+
+#define REZZAN_LIB_PATH     "/opt/rezzan/librezzan.a"
+
 /* Scaling factor for the effector map used to skip some of the more
    expensive deterministic steps. The actual divisor is set to
    2^EFF_MAP_SCALE2 bytes: */
@@ -284,6 +298,8 @@
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define REZZAN_DICT_ENV_VAR "__AFL_REZZAN_DICT_SHM_ID"
+#define REZZAN_TRIAGE_ENV_VAR "__AFL_REZZAN_TRIAGE_SHM_ID"
 
 /* In-code signatures for deferred and persistent mode. */
 
@@ -303,6 +319,20 @@
 
 #define FORKSRV_FD          198
 
+/* Handshake value sent by fork servers that can enforce the exec timeout on
+   their own (afl-llvm-rt.o.c). A parent that wants this echoes the value
+   back; the server then expects the timeout (in ms) after the usual "was
+   killed" word and reports a timed-out flag after the wait status. Without
+   the echo (e.g., AFL 2.x), it keeps to the plain four-byte protocol, as do
+   older runtimes, which send zero. */
+
+#define FORKSRV_TMOUT_SIG   0x544d4f55
+
+/* Extra slack (in ms) granted to a timeout-enforcing fork server before
+   afl-fuzz gives up polling the status pipe and kills the child itself: */
+
+#define FORKSRV_TMOUT_GRACE 50
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -99,6 +99,26 @@ static void find_obj(u8* argv0) {
 }
 
 
+/* Link the ReZZan runtime statically (librezzan.a), unless only compiling,
+   building a shared library, or REZZAN_STATIC=0. */
+
+static u8 rezzan_link_static(u32 argc, char** argv) {
+
+  u8* str = getenv("REZZAN_STATIC");
+  u32 i;
+
+  if (str && !strcmp(str, "0")) return 0;
+  if (access(REZZAN_LIB_PATH, R_OK)) return 0;
+
+  for (i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-shared") || !strcmp(argv[i], "-c") ||
+        !strcmp(argv[i], "-S") || !strcmp(argv[i], "-E")) return 0;
+
+  return 1;
+
+}
+
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char** argv) {
@@ -135,7 +155,13 @@ static void edit_params(u32 argc, char** argv) {
 #else
   if (getenv("AFL_CHECK_REZZAN") != NULL) {
     cc_params[cc_par_cnt++] = "-ldl";
-    cc_params[cc_par_cnt++] = "-lrezzan";
+    if (rezzan_link_static(argc, argv)) {
+      cc_params[cc_par_cnt++] = "-Wl,--whole-archive";
+      cc_params[cc_par_cnt++] = REZZAN_LIB_PATH;
+      cc_params[cc_par_cnt++] = "-Wl,--no-whole-archive";
+      cc_params[cc_par_cnt++] = "-lpthread";
+    } else
+      cc_params[cc_par_cnt++] = "-lrezzan";
   }
   cc_params[cc_par_cnt++] = "-Xclang";
   cc_params[cc_par_cnt++] = "-load";
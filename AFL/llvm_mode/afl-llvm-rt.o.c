@@ -36,6 +36,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/shm.h>
@@ -98,34 +100,115 @@ static void __afl_map_shm(void) {
 }
 
 
+/* Wait for the child to terminate (or stop, in persistent mode), killing it
+   once tmout milliseconds have elapsed. SIGCHLD is blocked in the fork
+   server, so we can sleep on it with sigtimedwait() instead of having the
+   parent arm a timer for every single execution. */
+
+static s32 __afl_wait_child(s32 child_pid, int* status, u32 tmout,
+                            u32* timed_out) {
+
+  struct timespec now, deadline, left;
+  sigset_t chld_set;
+  s32 res;
+
+  sigemptyset(&chld_set);
+  sigaddset(&chld_set, SIGCHLD);
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += tmout / 1000;
+  deadline.tv_nsec += (tmout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  *timed_out = 0;
+
+  while (1) {
+
+    /* SIGCHLD may be stale (left over from an earlier child, or raised by
+       SIGCONT), so always confirm with a non-blocking waitpid(). */
+
+    res = waitpid(child_pid, status,
+                  WNOHANG | (is_persistent ? WUNTRACED : 0));
+
+    if (res < 0) return -1;
+    if (res == child_pid) return res;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    left.tv_sec  = deadline.tv_sec - now.tv_sec;
+    left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0) {
+      left.tv_sec--;
+      left.tv_nsec += 1000000000;
+    }
+
+    if (left.tv_sec < 0) break;
+
+    if (sigtimedwait(&chld_set, NULL, &left) < 0 && errno == EAGAIN) break;
+
+  }
+
+  /* Out of time. */
+
+  *timed_out = 1;
+  kill(child_pid, SIGKILL);
+
+  return waitpid(child_pid, status, 0);
+
+}
+
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  static u32 hello = FORKSRV_TMOUT_SIG;
   s32 child_pid;
+  u32 msg[2], msg_len;
 
-  u8  child_stopped = 0;
+  u8  child_stopped = 0, pending;
+
+  sigset_t chld_set, old_set;
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+     assume we're not running in forkserver mode and just execute program.
+     The hello value offers to enforce the timeout ourselves. */
+
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
+
+  /* A parent that takes the offer echoes the hello back and then talks in
+     eight-byte messages. Any other word is the "was killed" flag of the
+     first message of the plain four-byte protocol (e.g., AFL 2.x). */
+
+  if (read(FORKSRV_FD, msg, 4) != 4) _exit(1);
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  msg_len = (msg[0] == FORKSRV_TMOUT_SIG) ? 8 : 4;
+  pending = (msg_len == 4);
+
+  sigemptyset(&chld_set);
+  sigaddset(&chld_set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_set, &old_set);
 
   while (1) {
 
-    u32 was_killed;
+    u32 timed_out = 0;
     int status;
 
-    /* Wait for parent by reading from the pipe. Abort if read fails. */
+    /* Wait for parent by reading from the pipe. Abort if read fails. The
+       message is the "was killed" flag, followed by the timeout in ms in
+       the extended protocol. */
 
-    if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
+    if (pending) pending = 0;
+    else if (read(FORKSRV_FD, msg, msg_len) != msg_len) _exit(1);
 
     /* If we stopped the child in persistent mode, but there was a race
        condition and afl-fuzz already issued SIGKILL, write off the old
        process. */
 
-    if (child_stopped && was_killed) {
+    if (child_stopped && msg[0]) {
       child_stopped = 0;
       if (waitpid(child_pid, &status, 0) < 0) _exit(1);
     }
@@ -137,10 +220,12 @@ static void __afl_start_forkserver(void) {
       child_pid = fork();
       if (child_pid < 0) _exit(1);
 
-      /* In child process: close fds, resume execution. */
+      /* In child process: close fds, restore the signal mask, resume
+         execution. */
 
       if (!child_pid) {
 
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
         return;
@@ -161,8 +246,13 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
-      _exit(1);
+    if (msg_len == 8) {
+
+      if (__afl_wait_child(child_pid, &status, msg[1], &timed_out) < 0)
+        _exit(1);
+
+    } else if (waitpid(child_pid, &status,
+                       is_persistent ? WUNTRACED : 0) < 0) _exit(1);
 
     /* In persistent mode, the child stops itself with SIGSTOP to indicate
        a successful run. In this case, we want to wake it up without forking
@@ -170,9 +260,12 @@ static void __afl_start_forkserver(void) {
 
     if (WIFSTOPPED(status)) child_stopped = 1;
 
-    /* Relay wait status to pipe, then loop back. */
+    /* Relay wait status (and the timeout flag) to pipe, then loop back. */
+
+    msg[0] = status;
+    msg[1] = timed_out;
 
-    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+    if (write(FORKSRV_FD + 1, msg, msg_len) != msg_len) _exit(1);
 
   }
 
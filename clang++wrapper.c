@@ -11,18 +11,45 @@ typedef uint32_t u32;
 static u8** cc_params;              /* Parameters passed to the real CC  */
 static u32  cc_par_cnt = 1;         /* Param count, including argv0      */
 
+/* Link the runtime statically (librezzan.a), unless only compiling, building
+   a shared library (which would get its own copy), or REZZAN_STATIC=0. */
+
+static u8 link_static(u32 argc, char** argv) {
+  char* str = getenv("REZZAN_STATIC");
+  if (str != NULL && !strcmp(str, "0")) return 0;
+  if (access("/opt/rezzan/librezzan.a", R_OK) != 0) return 0;
+  for (u32 i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-shared") || !strcmp(argv[i], "-c") ||
+        !strcmp(argv[i], "-S") || !strcmp(argv[i], "-E")) return 0;
+  return 1;
+}
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char** argv) {
   cc_params = calloc((argc + 128), sizeof(u8*));
   cc_params[0] = "clang++";
   cc_params[cc_par_cnt++] = "-ldl";
-  cc_params[cc_par_cnt++] = "-lrezzan";
+  if (link_static(argc, argv)) {
+    cc_params[cc_par_cnt++] = "-Wl,--whole-archive";
+    cc_params[cc_par_cnt++] = "/opt/rezzan/librezzan.a";
+    cc_params[cc_par_cnt++] = "-Wl,--no-whole-archive";
+    cc_params[cc_par_cnt++] = "-lpthread";
+  } else
+    cc_params[cc_par_cnt++] = "-lrezzan";
   cc_params[cc_par_cnt++] = "-Xclang";
   cc_params[cc_par_cnt++] = "-load";
   cc_params[cc_par_cnt++] = "-Xclang";
   cc_params[cc_par_cnt++] = "/opt/rezzan/rezzan.so";
 
+  /* Link in the runtime fast paths, so that they inline into callers. */
+  if (access("/opt/rezzan/librezzan.bc", R_OK) == 0) {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-mlink-bitcode-file";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "/opt/rezzan/librezzan.bc";
+  }
+
   while (--argc) {
     u8* cur = *(++argv);
     cc_params[cc_par_cnt++] = cur;
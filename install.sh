@@ -15,8 +15,27 @@ fi
 # Compile the rezzan instrumentation module
 clang++ `llvm-config --cxxflags` -Wl,-znodelete -fno-rtti -fPIC -shared rezzan_instrument.cpp -o rezzan.so `llvm-config --ldflags` || exit 0
 
-# Compile the rezzan runtime library
-gcc -g -fPIC -shared -o librezzan.so rezzan_runtime.c -O2 || exit 0
+# Compile the rezzan runtime library (without turning the interceptors' copy
+# loops back into calls to themselves)
+gcc -g -fPIC -shared -o librezzan.so rezzan_runtime.c -O2 \
+    -fno-tree-loop-distribute-patterns || exit 0
+
+# Compile the static rezzan runtime library, linked by default.  Its code
+# and data are kept in sections of their own (rezzan_*), so that fault
+# triage and leak detection can tell them apart from the program's
+gcc -g -fPIC -c -o rezzan_runtime.o rezzan_runtime.c -O2 -DREZZAN_STATIC \
+    -fno-tree-loop-distribute-patterns -fno-reorder-functions \
+    -fno-reorder-blocks-and-partition || exit 0
+objcopy --rename-section .text=rezzan_text \
+    --rename-section .data=rezzan_data --rename-section .bss=rezzan_bss \
+    rezzan_runtime.o || exit 0
+rm -f librezzan.a && ar rcs librezzan.a rezzan_runtime.o || exit 0
+
+# Compile the runtime fast paths to bitcode (linked in by the wrappers)
+clang -O2 -emit-llvm -c -o librezzan.bc rezzan_inline.c || exit 0
+
+# Compile the allocation trace replay tool
+gcc -O2 -o rezzan-replay rezzan_replay.c || exit 0
 
 # Compile the compiler wrapper
 clang clangwrapper.c -w -o clangwrapper || exit 0
@@ -32,9 +51,12 @@ rm -rf /usr/bin/rezzanclang++ || exit 0
 # Install
 mkdir /opt/rezzan || exit 0
 cp rezzan.so /opt/rezzan/rezzan.so || exit 0
+cp librezzan.bc /opt/rezzan/librezzan.bc || exit 0
+cp librezzan.a /opt/rezzan/librezzan.a || exit 0
 cp clangwrapper /opt/rezzan/rezzanclang || exit 0
 cp clang++wrapper /opt/rezzan/rezzanclang++ || exit 0
 cp librezzan.so /lib/librezzan.so || exit 0
+cp rezzan-replay /opt/rezzan/rezzan-replay || exit 0
 ln -s /opt/rezzan/rezzanclang /usr/bin/rezzanclang || exit 0
 ln -s /opt/rezzan/rezzanclang++ /usr/bin/rezzanclang++ || exit 0
 
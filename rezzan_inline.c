@@ -0,0 +1,68 @@
+/*
+ *
+ *   ReZZan runtime fast paths.
+ *   Compiled to LLVM bitcode (librezzan.bc) that the compiler wrappers link
+ *      into every module before optimization, so that the fast paths inline
+ *      into their callers.  The slow paths stay in librezzan.so.
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NONCE_ADDR      ((const uint64_t *)0x10000)
+#define PAGE_SIZE       ((uintptr_t)4096)
+
+typedef uint64_t __attribute__((__may_alias__)) Word;   // Any object
+
+/*
+ * The memcpy() interceptor of librezzan.so.  Called under its own name, as
+ * calls to memcpy() may be turned back into (unchecked) inline copies.
+ */
+extern void *__rezzan_memcpy(void *dst, const void *src, size_t n);
+
+/*
+ * Test if [ptr, ptr+n) is free of tokens.  Same as check_poisoned() in
+ * rezzan_runtime.c, minus the region classification.
+ */
+static inline __attribute__((__always_inline__)) bool __rezzan_clean(
+    const void *ptr, size_t n, size_t nonce_size)
+{
+    uint64_t nonce = *NONCE_ADDR;
+    uintptr_t iptr = (uintptr_t)ptr & ~(uintptr_t)7;
+    size_t end_delta = ((uintptr_t)ptr + n) % sizeof(Word);
+    uintptr_t end = ((uintptr_t)ptr + n + 7) & ~(uintptr_t)7;
+    for (; iptr < end; iptr += sizeof(Word))
+    {
+        uint64_t token = *(const Word *)iptr;
+        if (nonce_size == 61)
+            token &= ~(uint64_t)7;
+        if (token + nonce == 0)
+            return false;
+    }
+    if (end_delta != 0 && nonce_size == 61 && end % PAGE_SIZE != 0)
+    {
+        // Byte-accurate check against the token after the object:
+        uint64_t token = *(const Word *)end;
+        size_t boundary = token & 7;
+        if ((token & ~(uint64_t)7) + nonce == 0 && boundary != 0 &&
+                boundary < end_delta)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Small copies of a constant size `n' (see replaceMemInst() in
+ * rezzan_instrument.cpp), which fold down to a few token tests and moves.
+ * Anything that is not clean is left to the interceptor to report.
+ */
+void *__rezzan_memcpy_inline(void *dst, const void *src, size_t n,
+    size_t nonce_size)
+{
+    if (!__rezzan_clean(dst, n, nonce_size) || !__rezzan_clean(src, n, nonce_size))
+        return __rezzan_memcpy(dst, src, n);
+    __builtin_memcpy(dst, src, n);
+    return dst;
+}
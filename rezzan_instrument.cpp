@@ -11,8 +11,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fstream>
+#include <map>
+#include <set>
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
@@ -21,18 +24,50 @@
 
 using namespace llvm;
 
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FileSystem.h"
 
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
 #endif
 
+#define INLINE_MAX      64      // Largest memcpy() for the inline fast path
+
+#define NONCE_ADDR      0x10000 // The nonce.  Must match rezzan_runtime.c.
+
+// Placeholder for the nonce immediates (REZZAN_NONCE_IMM), which checks no
+// real token against until the runtime patches in the nonce.
+#define NONCE_PLACEHOLDER   "0x5a5a5a5a5a5a5a58"
+
+// Protection scopes (REZZAN_SCOPES).  Must match rezzan_runtime.c.
+#define SCOPE_HEAP      0x1
+#define SCOPE_STACK     0x2
+#define SCOPE_GLOBAL    0x4
+#define SCOPE_ALL       (SCOPE_HEAP | SCOPE_STACK | SCOPE_GLOBAL)
+
+// Randomized partial checking (REZZAN_GROUPS).  Must match rezzan_runtime.c.
+#define GROUPS_ADDR     0x10008
+#define GROUPS_MAX      64
+
 
 /*
  * LLVM ReZZan pass.
@@ -45,6 +80,13 @@ namespace
 
             static char ID;
             static size_t nonce_size;
+            static bool lowfat;
+            static unsigned scopes;
+            static size_t groups;
+            static bool check_gep;
+            static bool nonce_imm;
+            static bool inline_check;
+            static bool loop_version;
             ReZZan();
 
             bool runOnModule(Module &M) override;
@@ -53,71 +95,222 @@ namespace
 
 char ReZZan::ID = 0;
 size_t ReZZan::nonce_size = 61;
+bool ReZZan::lowfat = false;
+unsigned ReZZan::scopes = SCOPE_ALL;
+size_t ReZZan::groups = 0;
+bool ReZZan::check_gep = false;
+bool ReZZan::nonce_imm = false;
+bool ReZZan::inline_check = false;
+bool ReZZan::loop_version = false;
 
 ReZZan::ReZZan() : ModulePass(ID) {
 }
 
 /*
- * Build the check function.
+ * Load the nonce into `Reg'.  With REZZAN_NONCE_IMM, the nonce is an
+ * immediate instead, which the runtime patches in at startup (see
+ * buildNoncePatch()).  Each immediate is recorded in the __rezzan_nonce
+ * section, as an offset from the entry.
  */
-static void buildCheck(Module *M)
+static std::string loadNonce(const char *Reg)
 {
-    Function *F = M->getFunction("__rezzan_check");
-    if (F != nullptr)
-        F->setDoesNotThrow();
+    std::string Asm;
+    if (!ReZZan::nonce_imm)
+    {
+        Asm += "\tmov 0x10000, ";
+        Asm += Reg;
+        Asm += "\n";
+        return Asm;
+    }
+    Asm += "1:\tmovabsq $" NONCE_PLACEHOLDER ", ";
+    Asm += Reg;
+    Asm +=
+        "\n"
+        "\t.pushsection __rezzan_nonce, \"a\", @progbits\n"
+        "\t.balign 4\n"
+        "\t.long 1b + 2 - .\n"
+        "\t.popsection\n";
+    return Asm;
+}
 
+/*
+ * Build the constructor that patches the nonce into the helpers (see
+ * loadNonce()).  It runs before all other constructors, which may use the
+ * helpers, and after the runtime is initialized.  Weak, so that the runtime
+ * stays optional.
+ */
+static void buildNoncePatch(Module *M)
+{
+    LLVMContext &Cxt = M->getContext();
+    FunctionType *FTy = FunctionType::get(Type::getVoidTy(Cxt), {}, false);
+    Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,
+        "__rezzan_nonce_ctor", M);
+    BasicBlock *Entry = BasicBlock::Create(Cxt, "", F);
+    BasicBlock *Call = BasicBlock::Create(Cxt, "", F);
+    BasicBlock *Exit = BasicBlock::Create(Cxt, "", F);
+    IRBuilder<> builder(Entry);
+    GlobalVariable *Start = cast<GlobalVariable>(M->getOrInsertGlobal(
+        "__start___rezzan_nonce", builder.getInt8Ty()));
+    GlobalVariable *Stop = cast<GlobalVariable>(M->getOrInsertGlobal(
+        "__stop___rezzan_nonce", builder.getInt8Ty()));
+    Start->setVisibility(GlobalValue::HiddenVisibility);
+    Stop->setVisibility(GlobalValue::HiddenVisibility);
+    FunctionCallee Patch = M->getOrInsertFunction("__rezzan_patch_nonce",
+        builder.getVoidTy(), builder.getInt8PtrTy(), builder.getInt8PtrTy());
+    Function *PatchF = cast<Function>(Patch.getCallee());
+    PatchF->setLinkage(GlobalValue::ExternalWeakLinkage);
+    builder.CreateCondBr(builder.CreateIsNotNull(PatchF), Call, Exit);
+    builder.SetInsertPoint(Call);
+    builder.CreateCall(Patch, {Start, Stop});
+    builder.CreateBr(Exit);
+    builder.SetInsertPoint(Exit);
+    builder.CreateRetVoid();
+
+    appendToGlobalCtors(*M, F, 0);
+}
+
+/*
+ * Build a check function entry point, where `Last' addresses the last
+ * accessed byte.
+ */
+static std::string buildCheckEntry(const std::string &Name,
+    const std::string &Last)
+{
+    std::string L = ".L" + Name;
+    std::string Nonce = (ReZZan::nonce_imm? "%rax": "0x10000");
     std::string Asm;
     /*
-     * rdi: the origin pointer of the last byte [retain the delta]
-     * rax: the first token [check the token]
-     * rcx: the fs:40 value [the token baseline]
-     * rdx: the second token [check the page size offset]
-     * r8: the second token [check the token]
-     * r9: the second token [check the delta]
+     * Called with preserve_all, so only r11 is free, and the last byte is
+     * recomputed from the (preserved) arguments instead of being kept.
+     * With nonce_size == 61, a word t is a token iff t + nonce < 8
+     * (unsigned), and then t + nonce is its boundary.
+     * r11: the token [check the token]
+     * rax: the nonce (nonce_imm) or the last byte delta [check the delta]
      */
     Asm +=
-        ".type __rezzan_check, @function\n"
-        ".weak __rezzan_check\n"
-        "__rezzan_check:\n"
-        "addq $-0x1, %rdi\n"
-        "addq %rsi, %rdi\n"
-        "mov %rdi, %rax\n"
-        "andq $-0x8, %rax\n"
-        "mov %rax, %rdx\n"
-        "mov (%rax), %rax\n";
+        ".type " + Name + ", @function\n"
+        ".weak " + Name + "\n"
+        ".hidden " + Name + "\n" +
+        Name + ":\n";
+    if (ReZZan::nonce_imm) {
+        Asm += "mov %rax, -0x8(%rsp)\n";
+        Asm += loadNonce("%rax");
+    }
+    Asm +=
+        "lea " + Last + ", %r11\n"
+        "andq $-0x8, %r11\n"
+        "mov (%r11), %r11\n"
+        "addq " + Nonce + ", %r11\n";
     if (ReZZan::nonce_size == 61) {
         Asm +=
-            "andq $-0x8, %rax\n";
+            "cmpq $0x7, %r11\n"
+            "ja " + L + "_ok\n";
+    } else {
+        Asm +=
+            "jne " + L + "_ok\n";
     }
     Asm +=
-        "mov 0x10000, %rcx\n"
-        "addq %rcx, %rax\n"
-        "jne .Lok_a\n"
-        "ud2\n"
-        ".Lok_a:\n";
+        "ud2\n" +
+        L + "_ok:\n";
     if (ReZZan::nonce_size == 61) {
+        // The next token, unless on the next page:
+        Asm +=
+            "lea " + Last + ", %r11\n"
+            "orq $0x7, %r11\n"
+            "addq $0x1, %r11\n"
+            "test $0xfff, %r11d\n"
+            "je " + L + "_done\n"
+            "mov (%r11), %r11\n"
+            "addq " + Nonce + ", %r11\n"
+            "cmpq $0x7, %r11\n"
+            "ja " + L + "_done\n"
+            "test %r11, %r11\n"
+            "je " + L + "_done\n";
+        if (!ReZZan::nonce_imm)
+            Asm += "mov %rax, -0x8(%rsp)\n";
         Asm +=
-            "addq $0x8, %rdx\n"
-            "mov %rdx, %r8\n"
-            "and $0xfff, %edx\n"
-            "test %edx, %edx\n"
-            "je .Lok2_a\n"
-            "mov (%r8), %r8\n"
+            "lea " + Last + ", %rax\n"
+            "andq $0x7, %rax\n"
+            "cmp %rax, %r11\n";
+        if (!ReZZan::nonce_imm)
+            Asm += "mov -0x8(%rsp), %rax\n";
+        Asm +=
+            "ja " + L + "_done\n"
+            "ud2\n" +
+            L + "_done:\n";
+    }
+    if (ReZZan::nonce_imm)
+        Asm += "mov -0x8(%rsp), %rax\n";
+    Asm += "retq\n";
+    return Asm;
+}
+
+/*
+ * Build the check functions: a generic one for (ptr, size), and one per
+ * common access size for (ptr).
+ */
+static void buildCheck(Module *M)
+{
+    std::string Asm;
+    Asm += buildCheckEntry("__rezzan_check", "-0x1(%rdi,%rsi)");
+    Asm += buildCheckEntry("__rezzan_check1", "(%rdi)");
+    Asm += buildCheckEntry("__rezzan_check2", "0x1(%rdi)");
+    Asm += buildCheckEntry("__rezzan_check4", "0x3(%rdi)");
+    Asm += buildCheckEntry("__rezzan_check8", "0x7(%rdi)");
+    Asm += buildCheckEntry("__rezzan_check16", "0xf(%rdi)");
+
+    if (ReZZan::lowfat) {
+        /*
+         * Low-fat check: the access must be inside the object pointed to by
+         * the GEP base.  Pointers outside the low-fat heap (stack, globals,
+         * large heap objects) fall back to the token check.  Freed slots
+         * are poisoned whole, so a token in the first word of the slot
+         * means use-after-free.  The layout must match rezzan_runtime.c.
+         * rdi: the GEP base pointer
+         * rsi: the accessed pointer
+         * rdx: the access size
+         * rax: the size class [the slot size shift]
+         * r8: the slot size
+         * r9: the slot base
+         */
+        Asm +=
+            ".type __rezzan_lowfat_check, @function\n"
+            ".weak __rezzan_lowfat_check\n"
+            "__rezzan_lowfat_check:\n"
+            "movabsq $0x100000000000, %rax\n"
+            "mov %rdi, %r9\n"
+            "subq %rax, %r9\n"
+            "shrq $36, %r9\n"
+            "cmpq $17, %r9\n"
+            "jb .Llowfat_a\n"
+            "mov %rsi, %rdi\n"
+            "mov %rdx, %rsi\n"
+            "jmp __rezzan_check\n"
+            ".Llowfat_a:\n"
+            "mov %r9, %rcx\n"
+            "mov $0x10, %r8d\n"
+            "shlq %cl, %r8\n"
             "mov %r8, %r9\n"
-            "andq $-0x8, %r8\n"
-            "addq %rcx, %r8\n"
-            "jne .Lok2_a\n"
-            "andq $0x7, %r9\n"
-            "andq $0x7, %rdi\n"
-            "test %r9, %r9\n"
-            "je .Lok2_a\n"
-            "cmp %rdi, %r9\n"
-            "ja .Lok2_a\n"
+            "negq %r9\n"
+            "andq %rdi, %r9\n"
+            "subq %rdx, %r8\n"
+            "mov %rsi, %rax\n"
+            "subq %r9, %rax\n"
+            "cmpq %r8, %rax\n"
+            "jbe .Llowfat_ok_a\n"
             "ud2\n"
-            ".Lok2_a:\n";
+            ".Llowfat_ok_a:\n"
+            "mov (%r9), %r8\n";
+        if (ReZZan::nonce_size == 61)
+            Asm += "andq $-8, %r8\n";
+        Asm += loadNonce("%rax");
+        Asm +=
+            "addq %rax, %r8\n"
+            "jz .Llowfat_free_a\n"
+            "retq\n"
+            ".Llowfat_free_a:\n"
+            "ud2\n";
     }
-    Asm +=
-        "retq\n";
     M->appendModuleInlineAsm(Asm);
 }
 
@@ -125,7 +318,8 @@ static void buildCheck(Module *M)
  * Build the initialization code.
  */
 static void buildInit(Module *M, std::vector<Constant *> &Metadata_gbl_overflow, 
-                            std::vector<Constant *> &Metadata_gbl_underflow)
+                            std::vector<Constant *> &Metadata_gbl_underflow,
+                            std::vector<GlobalVariable *> &Consts)
 {
     {
         // Stack initialization
@@ -137,8 +331,9 @@ static void buildInit(Module *M, std::vector<Constant *> &Metadata_gbl_overflow,
         Asm +=
             ".type __init_stk_obj, @function\n"
             ".weak __init_stk_obj\n"
-            "__init_stk_obj:\n"
-            "\tmov 0x10000, %rax\n"
+            "__init_stk_obj:\n";
+        Asm += loadNonce("%rax");
+        Asm +=
             "\tnegq %rax\n"
             "\tmov %rax,(%rdi)\n"
             "\tadd $8,%rdi\n"
@@ -215,6 +410,54 @@ static void buildInit(Module *M, std::vector<Constant *> &Metadata_gbl_overflow,
         Value *UnderflowGVArray = builder.CreateBitCast(UnderflowGV,
             builder.getInt8PtrTy()->getPointerTo());
         builder.CreateCall(UnderflowInit, {UnderflowGVArray});
+
+        // Register the section with the runtime, so that its interceptors
+        // scan it for tokens.  Weak, so that the runtime stays optional:
+        GlobalVariable *Start = cast<GlobalVariable>(M->getOrInsertGlobal(
+            "__start___rezzan_gbls", builder.getInt8Ty()));
+        GlobalVariable *Stop = cast<GlobalVariable>(M->getOrInsertGlobal(
+            "__stop___rezzan_gbls", builder.getInt8Ty()));
+        Start->setVisibility(GlobalValue::HiddenVisibility);
+        Stop->setVisibility(GlobalValue::HiddenVisibility);
+        FunctionCallee Register = M->getOrInsertFunction("__rezzan_register_globals",
+            builder.getVoidTy(), builder.getInt8PtrTy(), builder.getInt8PtrTy());
+        Function *RegisterF = cast<Function>(Register.getCallee());
+        RegisterF->setLinkage(GlobalValue::ExternalWeakLinkage);
+        BasicBlock *Call = BasicBlock::Create(Cxt, "", F);
+        BasicBlock *Exit = BasicBlock::Create(Cxt, "", F);
+        builder.CreateCondBr(builder.CreateIsNotNull(RegisterF), Call, Exit);
+        builder.SetInsertPoint(Call);
+        builder.CreateCall(Register, {Start, Stop});
+        builder.CreateBr(Exit);
+        builder.SetInsertPoint(Exit);
+
+        // Register the constants, which are the last globals of the section
+        // (see runOnModule()), so that the runtime can tell the string
+        // literals from the (writable) data for AFL_REZZAN_DICT:
+        if (!Consts.empty())
+        {
+            GlobalVariable *Last = Consts.back();
+            Constant *Lo = ConstantExpr::getBitCast(Consts.front(),
+                builder.getInt8PtrTy());
+            Constant *Hi = ConstantExpr::getBitCast(
+                ConstantExpr::getGetElementPtr(Last->getValueType(), Last,
+                    ConstantInt::get(Type::getInt32Ty(Cxt), 1)),
+                builder.getInt8PtrTy());
+            FunctionCallee RegisterConsts = M->getOrInsertFunction(
+                "__rezzan_register_consts", builder.getVoidTy(),
+                builder.getInt8PtrTy(), builder.getInt8PtrTy());
+            Function *RegisterConstsF =
+                cast<Function>(RegisterConsts.getCallee());
+            RegisterConstsF->setLinkage(GlobalValue::ExternalWeakLinkage);
+            BasicBlock *Call = BasicBlock::Create(Cxt, "", F);
+            BasicBlock *Exit = BasicBlock::Create(Cxt, "", F);
+            builder.CreateCondBr(builder.CreateIsNotNull(RegisterConstsF),
+                Call, Exit);
+            builder.SetInsertPoint(Call);
+            builder.CreateCall(RegisterConsts, {Lo, Hi});
+            builder.CreateBr(Exit);
+            builder.SetInsertPoint(Exit);
+        }
         builder.CreateRetVoid();
 
         appendToGlobalCtors(*M, F, 1);
@@ -242,8 +485,9 @@ static void buildInit(Module *M, std::vector<Constant *> &Metadata_gbl_overflow,
             "\tjl __init_gbl_overflow\n"
             "\tlea __stop___rezzan_gbls(%rip),%rax\n"
             "\tcmpq %rax,%rsi\n"
-            "\tjge __init_gbl_overflow\n"
-            "\tmov 0x10000,%rax\n"
+            "\tjge __init_gbl_overflow\n";
+        Asm += loadNonce("%rax");
+        Asm +=
             "\tnegq %rax\n";
         if (ReZZan::nonce_size == 61) {
             Asm +=
@@ -269,9 +513,9 @@ static void buildInit(Module *M, std::vector<Constant *> &Metadata_gbl_overflow,
             "\tjl __init_gbl_underflow\n"
             "\tlea __stop___rezzan_gbls(%rip),%rax\n"
             "\tcmpq %rax,%rsi\n"
-            "\tjge __init_gbl_underflow\n"
-
-            "\tmov 0x10000,%rax\n"
+            "\tjge __init_gbl_underflow\n";
+        Asm += loadNonce("%rax");
+        Asm +=
             "\tnegq %rax\n"
             "\tandq $-8,%rax\n"
             "\tmov %rax,(%rsi)\n"
@@ -357,12 +601,211 @@ static void replaceAlloca(Module *M, Instruction *I,
     dels.push_back(Alloca);
 }
 
+/*
+ * Find the dynamic allocas (VLAs) of `F' that can be replaced by regions (see
+ * replaceRegionAlloca()), and the llvm.stacksave/llvm.stackrestore calls
+ * that scope them.  This is all or nothing: the regions outlive the VLA
+ * scopes, so every dynamic alloca of `F' must be a scoped VLA (alloca()
+ * memory must live until the function returns), and nothing else may move
+ * the stack pointer back (setjmp()).  Only worthwhile for VLAs in loops.
+ */
+static bool findRegionAllocas(Function &F, std::vector<AllocaInst *> &Allocas,
+    std::vector<Instruction *> &Scopes)
+{
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    bool InLoop = false;
+    for (auto &BB: F)
+    {
+        bool Scoped = false;
+        for (auto &I: BB)
+        {
+            if (auto *Call = dyn_cast<CallBase>(&I))
+            {
+                if (Call->hasFnAttr(Attribute::ReturnsTwice))
+                    return false;
+                auto *Intr = dyn_cast<IntrinsicInst>(Call);
+                if (Intr == nullptr)
+                    continue;
+                switch (Intr->getIntrinsicID())
+                {
+                    case Intrinsic::stacksave:
+                        for (User *Usr: Intr->users())
+                        {
+                            auto *Restore = dyn_cast<IntrinsicInst>(Usr);
+                            if (Restore == nullptr || Restore->getIntrinsicID() !=
+                                    Intrinsic::stackrestore)
+                                return false;
+                        }
+                        Scoped = true;
+                        Scopes.push_back(Intr);
+                        break;
+                    case Intrinsic::stackrestore:
+                    {
+                        auto *Save = dyn_cast<IntrinsicInst>(Intr->getArgOperand(0));
+                        if (Save == nullptr || Save->getIntrinsicID() !=
+                                Intrinsic::stacksave)
+                            return false;
+                        Scopes.push_back(Intr);
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                continue;
+            }
+            auto *Alloca = dyn_cast<AllocaInst>(&I);
+            if (Alloca == nullptr || Alloca->isStaticAlloca())
+                continue;
+            if (!Scoped)
+                return false;           // Not a VLA
+            InLoop = InLoop || (LI.getLoopFor(&BB) != nullptr);
+            Allocas.push_back(Alloca);
+        }
+    }
+    return InLoop;
+}
+
+/*
+ * Replace a dynamic alloca (VLA) in a loop.  Normally, each iteration would
+ * allocate the VLA again, and re-initialize its tokens with a pass over the
+ * whole object.  Instead, the VLA gets a region that lives until the
+ * function returns, and that is reused as-is (tokens in place) while the
+ * size does not change.  Otherwise the stack is restored to the base of the
+ * region, which also frees the regions allocated after it, and the region
+ * is allocated and initialized again.
+ */
+struct Region
+{
+    AllocaInst *Size;           // Object size, or UINT64_MAX if none
+    AllocaInst *Ptr;            // Region, or NULL if none
+    AllocaInst *Base;           // Stack pointer before the region
+};
+
+static void replaceRegionAlloca(Module *M, AllocaInst *Alloca,
+    const Region &R, const std::vector<Region> &Regions,
+    std::vector<Instruction *> &dels)
+{
+    LLVMContext &Cxt = M->getContext();
+    const DataLayout &DL = M->getDataLayout();
+    BasicBlock *Head = Alloca->getParent();
+    Function *F = Head->getParent();
+    BasicBlock *Join  = Head->splitBasicBlock(Alloca);
+    BasicBlock *Alloc = BasicBlock::Create(Cxt, "", F, Join);
+    BasicBlock *Free  = BasicBlock::Create(Cxt, "", F, Join);
+    BasicBlock *New   = BasicBlock::Create(Cxt, "", F, Join);
+    Head->getTerminator()->eraseFromParent();
+
+    IRBuilder<> builder(Head);
+    Type *Int64Ty = builder.getInt64Ty();
+    Type *Int8PtrTy = builder.getInt8PtrTy();
+    Value *OldSize = builder.CreateMul(
+        builder.CreateZExtOrTrunc(Alloca->getArraySize(), Int64Ty),
+        builder.getInt64(DL.getTypeAllocSize(Alloca->getAllocatedType())));
+    Value *Ptr = builder.CreateLoad(Int8PtrTy, R.Ptr);
+    Value *Size = builder.CreateLoad(Int64Ty, R.Size);
+    builder.CreateCondBr(builder.CreateICmpEQ(Size, OldSize), Join, Alloc);
+
+    builder.SetInsertPoint(Alloc);
+    builder.CreateCondBr(builder.CreateIsNull(Ptr), New, Free);
+
+    builder.SetInsertPoint(Free);
+    Value *Base = builder.CreateLoad(Int8PtrTy, R.Base);
+    for (const auto &Other: Regions)
+    {
+        // The stack grows down, so the regions below `Base' are freed:
+        Value *OtherPtr = builder.CreateLoad(Int8PtrTy, Other.Ptr);
+        Value *Freed = builder.CreateICmpULT(OtherPtr, Base);
+        builder.CreateStore(builder.CreateSelect(Freed,
+            ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)), OtherPtr),
+            Other.Ptr);
+        builder.CreateStore(builder.CreateSelect(Freed,
+            builder.getInt64(UINT64_MAX),
+            builder.CreateLoad(Int64Ty, Other.Size)), Other.Size);
+    }
+    builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::stackrestore),
+        {Base});
+    builder.CreateBr(New);
+
+    builder.SetInsertPoint(New);
+    builder.CreateStore(builder.CreateCall(Intrinsic::getDeclaration(M,
+        Intrinsic::stacksave)), R.Base);
+    Value *NewSize = builder.CreateAdd(OldSize,  // new size = old size + 16 (underflow) + delta (overflow)
+        builder.getInt64(15 + 2 * sizeof(uint64_t)));
+    AllocaInst *NewAlloca = builder.CreateAlloca(builder.getInt8Ty(), NewSize);
+    NewAlloca->setAlignment(Align(2 * sizeof(uint64_t)));
+    FunctionCallee Init = M->getOrInsertFunction("__init_stk_obj",
+        builder.getVoidTy(), Int8PtrTy, Int64Ty);
+    builder.CreateCall(Init, {NewAlloca, OldSize});
+    builder.CreateStore(NewAlloca, R.Ptr);
+    builder.CreateStore(OldSize, R.Size);
+    builder.CreateBr(Join);
+
+    builder.SetInsertPoint(Alloca);
+    PHINode *Region = builder.CreatePHI(Int8PtrTy, 2);
+    Region->addIncoming(Ptr, Head);
+    Region->addIncoming(NewAlloca, New);
+    Value *Ptr0 = builder.CreateGEP(Region, builder.getInt64(2 * sizeof(uint64_t)));
+    Alloca->replaceAllUsesWith(builder.CreateBitCast(Ptr0, Alloca->getType()));
+    dels.push_back(Alloca);
+}
+
+/*
+ * Replace the VLAs of `F' in loops (see replaceRegionAlloca()).  The region
+ * state lives in the entry block, and the VLA scopes are dropped.
+ */
+static bool replaceRegionAllocas(Module *M, Function &F,
+    std::vector<Instruction *> &dels)
+{
+    std::vector<AllocaInst *> Allocas;
+    std::vector<Instruction *> Scopes;
+    if (F.isDeclaration() || !findRegionAllocas(F, Allocas, Scopes))
+        return false;
+
+    // Splitting the entry block must not make static allocas dynamic:
+    BasicBlock &Entry = F.getEntryBlock();
+    Instruction *First = &*Entry.getFirstInsertionPt();
+    for (auto i = Entry.begin(); i != Entry.end(); )
+    {
+        auto *Alloca = dyn_cast<AllocaInst>(&*i++);
+        if (Alloca != nullptr && Alloca != First && Alloca->isStaticAlloca())
+            Alloca->moveBefore(First);
+    }
+
+    IRBuilder<> builder(&Entry, Entry.getFirstInsertionPt());
+    std::vector<Region> Regions;
+    for (size_t i = 0; i < Allocas.size(); i++)
+    {
+        Region R;
+        R.Size = builder.CreateAlloca(builder.getInt64Ty());
+        R.Ptr  = builder.CreateAlloca(builder.getInt8PtrTy());
+        R.Base = builder.CreateAlloca(builder.getInt8PtrTy());
+        Regions.push_back(R);
+    }
+    for (const auto &R: Regions)
+    {
+        builder.CreateStore(builder.getInt64(UINT64_MAX), R.Size);
+        builder.CreateStore(ConstantPointerNull::get(builder.getInt8PtrTy()),
+            R.Ptr);
+    }
+    for (size_t i = 0; i < Allocas.size(); i++)
+        replaceRegionAlloca(M, Allocas[i], Regions[i], Regions, dels);
+
+    // Restores first, as they use the saves:
+    std::stable_partition(Scopes.begin(), Scopes.end(), [](Instruction *I) {
+        return cast<IntrinsicInst>(I)->getIntrinsicID() == Intrinsic::stackrestore;
+    });
+    for (auto *I: Scopes)
+        I->eraseFromParent();
+    return true;
+}
+
 /*
  * Replace global variables
  */
 static void replaceGlobal(Module *M, GlobalVariable *GV,
     std::vector<Constant *> &Metadata_gbl_overflow, std::vector<Constant *> &Metadata_gbl_underflow,
-    std::vector<GlobalVariable *> &dels)
+    std::vector<GlobalVariable *> &dels, std::vector<GlobalVariable *> &consts)
 {
     if (GV->isDeclaration() || GV->hasSection() || GV->isThreadLocal())
         return;
@@ -415,6 +858,8 @@ static void replaceGlobal(Module *M, GlobalVariable *GV,
 
     NewGV->setName(std::string("rezzan_gv_")+GV->getName());
     dels.push_back(GV);
+    if (GV->isConstant())
+        consts.push_back(NewGV);
 
     Constant *Idxs00[2] = {ConstantInt::get(Int32Ty, 0),
                            ConstantInt::get(Int32Ty, 0)};
@@ -480,22 +925,49 @@ static bool shouldCheck(Module *M, Value *Ptr)
 }
 
 /*
- * Insert a memory access check if necessary.
+ * Test if `F' is a runtime fast path linked in from librezzan.bc (see
+ * rezzan_inline.c).  These access tokens, so must not be instrumented.
  */
-static bool insertCheck(Module *M, Instruction *I)
+static bool isRuntime(const Function &F)
 {
-    const DataLayout *DL = &M->getDataLayout();
-    IRBuilder<> builder(I);
+    return F.getName().startswith("__rezzan_");
+}
 
-    Value *Ptr = nullptr;
-    if (LoadInst *Load = dyn_cast<LoadInst>(I))
-        Ptr = Load->getPointerOperand();
-    else if (StoreInst *Store = dyn_cast<StoreInst>(I))
-        Ptr = Store->getPointerOperand();
-    if (Ptr == nullptr)
-        return false;
+/*
+ * Determine if an access through `Ptr' may hit a token.
+ */
+static bool needsCheck(Module *M, Value *Ptr)
+{
     if (!shouldCheck(M, Ptr))
         return false;
+    if (ReZZan::scopes == 0)
+        return false;           // No tokens anywhere
+    Value *Obj = getUnderlyingObject(Ptr);
+    if (isa<AllocaInst>(Obj) && !(ReZZan::scopes & SCOPE_STACK))
+        return false;           // Unwrapped stack object
+    if (isa<GlobalVariable>(Obj) && !(ReZZan::scopes & SCOPE_GLOBAL))
+        return false;           // Unwrapped global object
+    return true;
+}
+
+/*
+ * Get the pointer operand of a load or store, or nullptr.
+ */
+static Value *getAccessPtr(Instruction *I)
+{
+    if (LoadInst *Load = dyn_cast<LoadInst>(I))
+        return Load->getPointerOperand();
+    else if (StoreInst *Store = dyn_cast<StoreInst>(I))
+        return Store->getPointerOperand();
+    return nullptr;
+}
+
+/*
+ * Get the number of bytes accessed through `Ptr'.
+ */
+static size_t getAccessSize(Module *M, Value *Ptr)
+{
+    const DataLayout *DL = &M->getDataLayout();
     size_t size = 0;
     Type *Ty = Ptr->getType();
     if (auto *PtrTy = dyn_cast<PointerType>(Ty))
@@ -503,18 +975,545 @@ static bool insertCheck(Module *M, Instruction *I)
         Ty = PtrTy->getElementType();
         size = DL->getTypeAllocSize(Ty);
     }
+    return size;
+}
+
+/*
+ * The check entry points preserve all registers but r11 (see buildCheck()),
+ * and are hidden, so that calls never go through the PLT.
+ */
+static void setCheckConv(CallInst *Call)
+{
+    Function *F = Call->getCalledFunction();
+    F->setCallingConv(CallingConv::PreserveAll);
+    F->setVisibility(GlobalValue::HiddenVisibility);
+    F->setDoesNotThrow();
+    Call->setCallingConv(CallingConv::PreserveAll);
+}
+
+/*
+ * The trap block of a function (REZZAN_INLINE_CHECK).  All inline checks of
+ * the function branch to it on failure, with their site ID in r11, so that
+ * each function has one (cold) ud2 instead of one per check.
+ */
+struct Trap
+{
+    BasicBlock *BB;
+    PHINode *Site;                  // The failed check's site ID
+    uint32_t next;                  // The next site ID
+};
+
+static std::map<Function *, Trap> traps;
+
+static Trap &getTrap(Function *F)
+{
+    Trap &T = traps[F];
+    if (T.BB != nullptr)
+        return T;
+    T.BB = BasicBlock::Create(F->getContext(), "rezzan_trap", F);
+    IRBuilder<> builder(T.BB);
+    T.Site = builder.CreatePHI(builder.getInt32Ty(), 0);
+    FunctionType *FTy = FunctionType::get(builder.getVoidTy(),
+        {builder.getInt32Ty()}, false);
+    builder.CreateCall(InlineAsm::get(FTy, "ud2", "{r11}",
+        /*hasSideEffects=*/true), {T.Site});
+    builder.CreateUnreachable();
+    return T;
+}
+
+/*
+ * Test if `F' is cold enough to keep the smaller out-of-line checks.
+ */
+static bool isCold(const Function &F)
+{
+    if (F.hasFnAttribute(Attribute::Cold) || F.hasOptSize())
+        return true;
+    auto Count = F.getEntryCount();
+    return (Count.hasValue() && Count->getCount() == 0);
+}
+
+/*
+ * Emit an inline version of the `size' byte check (see buildCheckEntry()) at
+ * the builder's insertion point.
+ */
+static void emitInlineCheck(IRBuilder<> &builder, Value *Ptr, size_t size)
+{
+    LLVMContext &Cxt = builder.getContext();
+    BasicBlock *BB = builder.GetInsertBlock();
+    Function *F = BB->getParent();
+    Trap &T = getTrap(F);
+    ConstantInt *Site = builder.getInt32(T.next++);
+    MDNode *Cold = MDBuilder(Cxt).createBranchWeights(1, 1 << 20);
+    Type *Int64Ty = builder.getInt64Ty();
+    PointerType *Int64PtrTy = Int64Ty->getPointerTo();
+
+    // The check goes between BB and Cont:
+    BasicBlock *Cont = BB->splitBasicBlock(builder.GetInsertPoint());
+    BB->getTerminator()->eraseFromParent();
+    builder.SetInsertPoint(BB);
+
+    LoadInst *Nonce = builder.CreateAlignedLoad(Int64Ty,
+        ConstantExpr::getIntToPtr(builder.getInt64(NONCE_ADDR), Int64PtrTy),
+        Align(8));
+    Nonce->setMetadata(LLVMContext::MD_invariant_load,
+        MDNode::get(Cxt, {}));
+    Value *Last = builder.CreateAdd(builder.CreatePtrToInt(Ptr, Int64Ty),
+        builder.getInt64(size - 1));
+    Value *Word = builder.CreateAnd(Last, builder.getInt64(-8));
+    Value *Token = builder.CreateAdd(builder.CreateAlignedLoad(Int64Ty,
+        builder.CreateIntToPtr(Word, Int64PtrTy), Align(8)), Nonce);
+    if (ReZZan::nonce_size != 61)
+    {
+        builder.CreateCondBr(builder.CreateIsNull(Token), T.BB, Cont, Cold);
+        T.Site->addIncoming(Site, BB);
+        return;
+    }
+    BasicBlock *Next = BasicBlock::Create(Cxt, "", F, Cont);
+    builder.CreateCondBr(builder.CreateICmpULE(Token, builder.getInt64(7)),
+        T.BB, Next, Cold);
+    T.Site->addIncoming(Site, BB);
+
+    // The next token, unless on the next page:
+    builder.SetInsertPoint(Next);
+    Word = builder.CreateAdd(builder.CreateOr(Last, builder.getInt64(7)),
+        builder.getInt64(1));
+    BasicBlock *Tok = BasicBlock::Create(Cxt, "", F, Cont);
+    builder.CreateCondBr(builder.CreateIsNull(
+        builder.CreateAnd(Word, builder.getInt64(0xfff))), Cont, Tok);
+    builder.SetInsertPoint(Tok);
+    Token = builder.CreateAdd(builder.CreateAlignedLoad(Int64Ty,
+        builder.CreateIntToPtr(Word, Int64PtrTy), Align(8)), Nonce);
+    // A token with boundary b in 1..7 ends the object b bytes into the word:
+    Value *Bad = builder.CreateICmpULT(
+        builder.CreateSub(Token, builder.getInt64(1)),
+        builder.CreateAnd(Last, builder.getInt64(7)));
+    builder.CreateCondBr(Bad, T.BB, Cont, Cold);
+    T.Site->addIncoming(Site, Tok);
+}
+
+/*
+ * Emit a check of the `size' bytes at `Ptr' before `I'.  `Base' is the
+ * pointer that `Ptr' was derived from, if known (for low-fat checks).
+ */
+static void emitCheck(Module *M, Instruction *I, Value *Ptr, size_t size,
+    Value *Base = nullptr)
+{
+    IRBuilder<> builder(I);
     Value *Size = builder.getInt64(size); // calculating the affected memory size
 
+    // Partial checking: only check if the site's group is enabled this exec
+    if (ReZZan::groups != 0)
+    {
+        static size_t group_next = 0;
+        Value *Mask = builder.CreateLoad(builder.getInt64Ty(),
+            ConstantExpr::getIntToPtr(builder.getInt64(GROUPS_ADDR),
+                builder.getInt64Ty()->getPointerTo()));
+        Value *Bit = builder.CreateAnd(Mask,
+            builder.getInt64(1ull << (group_next++ % ReZZan::groups)));
+        Instruction *Then = SplitBlockAndInsertIfThen(
+            builder.CreateIsNotNull(Bit), I, /*Unreachable=*/false);
+        builder.SetInsertPoint(Then);
+    }
+
+    // Low-fat mode: check GEP-derived pointers against the base object
+    auto *GEP = dyn_cast<GEPOperator>(Ptr->stripPointerCasts());
+    if (ReZZan::lowfat && Base == nullptr && GEP != nullptr)
+        Base = GEP->getPointerOperand();
+    if (ReZZan::lowfat && Base != nullptr)
+    {
+        Base = builder.CreateBitCast(Base, builder.getInt8PtrTy());
+        Ptr = builder.CreateBitCast(Ptr, builder.getInt8PtrTy());
+        FunctionCallee Check = M->getOrInsertFunction("__rezzan_lowfat_check",
+            builder.getVoidTy(), builder.getInt8PtrTy(),
+            builder.getInt8PtrTy(), builder.getInt64Ty());
+        builder.CreateCall(Check, {Base, Ptr, Size});
+        return;
+    }
+
     Ptr = builder.CreateBitCast(Ptr, builder.getInt8PtrTy()); // cast the real operating pointer address
 
-    FunctionCallee Check = M->getOrInsertFunction("__rezzan_check",
-        builder.getVoidTy(), builder.getInt8PtrTy(),
-        builder.getInt64Ty());
+    if (ReZZan::inline_check && !isCold(*I->getFunction()))
+    {
+        emitInlineCheck(builder, Ptr, size);
+        return;
+    }
 
-    builder.CreateCall(Check, {Ptr, Size});
+    // The common sizes have their own entry points (see buildCheck()):
+    CallInst *Call = nullptr;
+    switch (size)
+    {
+        case 1: case 2: case 4: case 8: case 16:
+        {
+            FunctionCallee Check = M->getOrInsertFunction(
+                "__rezzan_check" + std::to_string(size), builder.getVoidTy(),
+                builder.getInt8PtrTy());
+            Call = builder.CreateCall(Check, {Ptr});
+            break;
+        }
+        default:
+        {
+            FunctionCallee Check = M->getOrInsertFunction("__rezzan_check",
+                builder.getVoidTy(), builder.getInt8PtrTy(),
+                builder.getInt64Ty());
+            Call = builder.CreateCall(Check, {Ptr, Size});
+            break;
+        }
+    }
+    setCheckConv(Call);
+}
+
+/*
+ * Insert a memory access check if necessary.
+ */
+static bool insertCheck(Module *M, Instruction *I)
+{
+    Value *Ptr = getAccessPtr(I);
+    if (Ptr == nullptr || !needsCheck(M, Ptr))
+        return false;
+    emitCheck(M, I, Ptr, getAccessSize(M, Ptr));
+    return true;
+}
+
+/*
+ * Check at pointer derivation (REZZAN_CHECK_GEP).  A pointer derived with a
+ * variable index (`p = base + i') is often dereferenced several times at
+ * small constant offsets (`p->x', `p[1]', ...).  If these accesses follow
+ * in the same basic block with no call in between (which could free the
+ * object), check the lowest and the highest access once, and skip the
+ * rest: if both ends are inside the same object, so is everything between.
+ */
+#define GEP_CHECK_MAX   64      // Largest offset covered by a GEP check
+
+struct GEPCheck
+{
+    GetElementPtrInst *GEP;
+    Instruction *Before;        // First access
+    int64_t lo, lo_size;        // Lowest access
+    int64_t hi, hi_size;        // Highest access
+};
+
+static bool planGEPCheck(Module *M, GetElementPtrInst *GEP, GEPCheck &Plan,
+    std::set<Instruction *> &Covered)
+{
+    if (GEP->hasAllConstantIndices())
+        return false;
+    const DataLayout &DL = M->getDataLayout();
+    std::vector<Instruction *> Accesses;
+    for (auto i = std::next(GEP->getIterator()), e = GEP->getParent()->end();
+            i != e; ++i)
+    {
+        Instruction *I = &*i;
+        if (isa<CallBase>(I) && !isa<DbgInfoIntrinsic>(I))
+            break;
+        Value *Ptr = getAccessPtr(I);
+        if (Ptr == nullptr || Covered.count(I) != 0 || !needsCheck(M, Ptr))
+            continue;
+        APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+        if (Ptr->stripAndAccumulateConstantOffsets(DL, Offset,
+                /*AllowNonInbounds=*/true) != GEP)
+            continue;
+        int64_t lo = Offset.getSExtValue();
+        int64_t size = (int64_t)getAccessSize(M, Ptr);
+        if (lo < 0 || size <= 0 || lo + size > GEP_CHECK_MAX)
+            continue;
+        if (Accesses.empty())
+        {
+            Plan.Before = I;
+            Plan.lo = Plan.hi = lo;
+            Plan.lo_size = Plan.hi_size = size;
+        }
+        if (lo < Plan.lo)
+        {
+            Plan.lo = lo;
+            Plan.lo_size = size;
+        }
+        if (lo + size > Plan.hi + Plan.hi_size)
+        {
+            Plan.hi = lo;
+            Plan.hi_size = size;
+        }
+        Accesses.push_back(I);
+    }
+    if (Accesses.size() < 2)
+        return false;           // Nothing to save
+    Plan.GEP = GEP;
+    Covered.insert(Accesses.begin(), Accesses.end());
     return true;
 }
 
+static size_t insertGEPCheck(Module *M, const GEPCheck &Plan)
+{
+    // Before emitCheck(), which may split the block:
+    IRBuilder<> builder(Plan.Before);
+    Value *Ptr = builder.CreateBitCast(Plan.GEP, builder.getInt8PtrTy());
+    Value *Lo = builder.CreateGEP(Ptr, builder.getInt64(Plan.lo));
+    Value *Hi = builder.CreateGEP(Ptr, builder.getInt64(Plan.hi));
+    Value *Base = Plan.GEP->getPointerOperand();
+    emitCheck(M, Plan.Before, Lo, Plan.lo_size, Base);
+    if (Plan.hi == Plan.lo && Plan.hi_size == Plan.lo_size)
+        return 1;
+    emitCheck(M, Plan.Before, Hi, Plan.hi_size, Base);
+    return 2;
+}
+
+/*
+ * Loop versioning (REZZAN_LOOP_VERSION).  The trip counts of many hot loops
+ * (NUL-terminated scans, record walks, ...) are data dependent, so their
+ * checks cannot be hoisted.  Instead, the accesses that step through memory
+ * run unchecked for as many iterations as they stay inside memory that is
+ * known to be token-free (see __rezzan_clean_bound() in rezzan_runtime.c).
+ * This budget is renewed from the current pointers when it runs out, and
+ * the loop only continues in a checked copy if that makes no progress.
+ */
+#define LOOP_VERSION_MAX    256     // Largest loop (in instructions) to version
+#define LOOP_BOUND_MAX      4       // Most start pointers per versioned loop
+
+struct LoopStart
+{
+    const SCEV *S;                  // The pointer in the first iteration
+    uint64_t step;                  // The pointer increment per iteration
+    Value *Ptr;                     // S (as an integer) in the preheader
+};
+
+struct LoopAccess
+{
+    Instruction *I;
+    size_t start;                   // Index of its LoopStart
+    size_t size;
+};
+
+/*
+ * Find the checked accesses of `L' that step forward through memory.
+ * Fails if there are none, or if `L' cannot be versioned.
+ */
+static bool findLoopAccesses(Module *M, Loop *L, DominatorTree &DT,
+    ScalarEvolution &SE, std::vector<LoopStart> &Starts,
+    std::vector<LoopAccess> &Accesses)
+{
+    Starts.clear();
+    Accesses.clear();
+    if (!L->isInnermost() || L->getLoopPreheader() == nullptr ||
+            L->getLoopLatch() == nullptr || !L->hasDedicatedExits() ||
+            !L->isLCSSAForm(DT))
+        return false;
+    size_t n = 0;
+    for (auto *BB: L->blocks())
+    {
+        for (auto &I: *BB)
+        {
+            // No calls, which may free or allocate (and write tokens):
+            if (++n > LOOP_VERSION_MAX ||
+                    (isa<CallBase>(&I) && !isa<IntrinsicInst>(&I)))
+                return false;
+            Value *Ptr = getAccessPtr(&I);
+            if (Ptr == nullptr || !needsCheck(M, Ptr))
+                continue;
+            if (ReZZan::lowfat && isa<GEPOperator>(Ptr->stripPointerCasts()))
+                continue;           // Keeps its low-fat check
+            size_t size = getAccessSize(M, Ptr);
+            auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Ptr));
+            if (size == 0 || AR == nullptr || AR->getLoop() != L ||
+                    !AR->isAffine() || !isSafeToExpand(AR->getStart(), SE))
+                continue;
+            auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+            if (Step == nullptr || Step->getAPInt().getSExtValue() <= 0)
+                continue;
+            uint64_t step = Step->getAPInt().getZExtValue();
+            size_t i = 0;
+            while (i < Starts.size() && Starts[i].S != AR->getStart())
+                i++;
+            if (i == Starts.size())
+            {
+                if (Starts.size() >= LOOP_BOUND_MAX)
+                    continue;
+                Starts.push_back({AR->getStart(), step, nullptr});
+            }
+            if (Starts[i].step != step)
+                continue;
+            Accesses.push_back({&I, i, size});
+        }
+    }
+    return !Accesses.empty();
+}
+
+/*
+ * Emit the budget of unchecked iterations after iteration `K', i.e., the
+ * first iteration in which an access may leave the memory known to be
+ * token-free.  The budget is `K' itself if nothing is known.
+ */
+static Value *emitLoopBudget(Module *M, IRBuilder<> &builder,
+    const std::vector<LoopStart> &Starts,
+    const std::vector<LoopAccess> &Accesses, Value *K)
+{
+    FunctionCallee CleanBound = M->getOrInsertFunction("__rezzan_clean_bound",
+        builder.getInt64Ty(), builder.getInt8PtrTy());
+    std::vector<std::pair<Value *, Value *>> Extents;    // Pointer, extent
+    for (const auto &Start: Starts)
+    {
+        Value *Ptr = builder.CreateAdd(Start.Ptr,
+            builder.CreateMul(K, builder.getInt64(Start.step)));
+        Value *Bound = builder.CreateCall(CleanBound,
+            {builder.CreateIntToPtr(Ptr, builder.getInt8PtrTy())});
+        Extents.push_back({Ptr, builder.CreateSub(Bound, Ptr)});
+    }
+    Value *Budget = nullptr;
+    for (const auto &Access: Accesses)
+    {
+        Value *Extent = Extents[Access.start].second;
+        Value *Size = builder.getInt64(Access.size);
+        Value *N = builder.CreateSelect(builder.CreateICmpUGE(Extent, Size),
+            builder.CreateAdd(K, builder.CreateAdd(builder.CreateUDiv(
+                builder.CreateSub(Extent, Size),
+                builder.getInt64(Starts[Access.start].step)),
+                builder.getInt64(1))),
+            K);
+        Budget = (Budget == nullptr? N: builder.CreateSelect(
+            builder.CreateICmpULT(N, Budget), N, Budget));
+    }
+    return Budget;
+}
+
+/*
+ * Version `L' for `Accesses'.  The original loop runs unchecked, counting
+ * its iterations, and renews its budget whenever the count reaches it.  If the
+ * budget cannot be renewed, it branches to the header of a checked copy
+ * with its current state.
+ */
+static void versionLoop(Module *M, Loop *L, ScalarEvolution &SE,
+    std::vector<LoopStart> &Starts, const std::vector<LoopAccess> &Accesses,
+    std::set<Instruction *> &Unchecked, std::set<BasicBlock *> &Done)
+{
+    LLVMContext &Cxt = M->getContext();
+    BasicBlock *Preheader = L->getLoopPreheader();
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *Latch = L->getLoopLatch();
+    Function *F = Header->getParent();
+    IRBuilder<> builder(Preheader->getTerminator());
+    Type *Int64Ty = builder.getInt64Ty();
+
+    SCEVExpander Expander(SE, M->getDataLayout(), "rezzan");
+    for (auto &Start: Starts)
+    {
+        Value *Ptr = Expander.expandCodeFor(Start.S, Start.S->getType(),
+            Preheader->getTerminator());
+        Start.Ptr = (Ptr->getType()->isPointerTy()?
+            builder.CreatePtrToInt(Ptr, Int64Ty):
+            builder.CreateZExtOrTrunc(Ptr, Int64Ty));
+    }
+    for (const auto &Access: Accesses)
+        Unchecked.insert(Access.I);
+
+    // The checked copy, entered from the original header:
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    for (auto *BB: L->blocks())
+    {
+        BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".checked", F);
+        VMap[BB] = NewBB;
+        Blocks.push_back(NewBB);
+    }
+    remapInstructionsInBlocks(Blocks, VMap);
+    BasicBlock *NewHeader = cast<BasicBlock>(VMap[Header]);
+    BasicBlock *Bail = BasicBlock::Create(Cxt, "", F, NewHeader);
+    for (auto &Phi: Header->phis())
+    {
+        auto *NewPhi = cast<PHINode>(VMap[&Phi]);
+        int i = NewPhi->getBasicBlockIndex(Preheader);
+        NewPhi->setIncomingBlock(i, Bail);
+        NewPhi->setIncomingValue(i, &Phi);
+    }
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    for (auto *Exit: Exits)             // Dedicated, and in LCSSA form
+    {
+        for (auto &Phi: Exit->phis())
+        {
+            for (unsigned i = 0, e = Phi.getNumIncomingValues(); i < e; i++)
+            {
+                BasicBlock *BB = Phi.getIncomingBlock(i);
+                if (!L->contains(BB))
+                    continue;
+                Value *V = Phi.getIncomingValue(i);
+                auto It = VMap.find(V);
+                if (It != VMap.end())
+                    V = It->second;
+                Phi.addIncoming(V, cast<BasicBlock>(VMap[BB]));
+            }
+        }
+    }
+
+    // Count the iterations of the original, and renew the budget (starting
+    // with none, so the first iteration sets it):
+    BasicBlock *Body = Header->splitBasicBlock(Header->getFirstNonPHI());
+    if (Latch == Header)
+        Latch = Body;
+    BasicBlock *Renew = BasicBlock::Create(Cxt, "", F, Body);
+    MDNode *Likely = MDBuilder(Cxt).createBranchWeights(1 << 20, 1);
+    builder.SetInsertPoint(Header->getTerminator());
+    PHINode *K = builder.CreatePHI(Int64Ty, 2);
+    PHINode *N = builder.CreatePHI(Int64Ty, 2);
+    Header->getTerminator()->eraseFromParent();
+    builder.SetInsertPoint(Header);
+    builder.CreateCondBr(builder.CreateICmpULT(K, N), Body, Renew, Likely);
+    builder.SetInsertPoint(Renew);
+    Value *NewN = emitLoopBudget(M, builder, Starts, Accesses, K);
+    builder.CreateCondBr(builder.CreateICmpULT(K, NewN), Body, Bail, Likely);
+    builder.SetInsertPoint(&Body->front());
+    PHINode *BodyN = builder.CreatePHI(Int64Ty, 2);
+    BodyN->addIncoming(N, Header);
+    BodyN->addIncoming(NewN, Renew);
+    builder.SetInsertPoint(Latch->getTerminator());
+    K->addIncoming(builder.getInt64(0), Preheader);
+    K->addIncoming(builder.CreateAdd(K, builder.getInt64(1)), Latch);
+    N->addIncoming(builder.getInt64(0), Preheader);
+    N->addIncoming(BodyN, Latch);
+    builder.SetInsertPoint(Bail);
+    builder.CreateBr(NewHeader);
+
+    Done.insert(Header);
+    Done.insert(NewHeader);
+}
+
+/*
+ * Version the loops of `F', and add the accesses that are not to be checked
+ * to `Unchecked'.  Returns the number of versioned loops.
+ */
+static size_t versionLoops(Module *M, Function &F,
+    std::set<Instruction *> &Unchecked)
+{
+    TargetLibraryInfoImpl TLII(Triple(M->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    std::set<BasicBlock *> Done;
+    size_t n = 0;
+    while (true)
+    {
+        // Versioning invalidates the analyses, so one loop at a time:
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        AssumptionCache AC(F);
+        ScalarEvolution SE(F, TLI, AC, DT, LI);
+        Loop *Target = nullptr;
+        std::vector<LoopStart> Starts;
+        std::vector<LoopAccess> Accesses;
+        for (auto *L: LI.getLoopsInPreorder())
+        {
+            if (!L->isInnermost() || !Done.insert(L->getHeader()).second)
+                continue;
+            simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr, false);
+            formLCSSA(*L, DT, &LI, &SE);
+            if (findLoopAccesses(M, L, DT, SE, Starts, Accesses))
+            {
+                Target = L;
+                break;
+            }
+        }
+        if (Target == nullptr)
+            return n;
+        versionLoop(M, Target, SE, Starts, Accesses, Unchecked, Done);
+        n++;
+    }
+}
+
 /*
  * Disable the loop idom optimization in LLVM.
  * Because these optimizations will jump over our instrumentation.
@@ -532,7 +1531,18 @@ static void replaceMemInst(Module *M, Instruction *I,
 	    Value* Size = MemInst->getLength();
         Dest = builder.CreateBitCast(Dest, builder.getInt8PtrTy());
         Src = builder.CreateBitCast(Src, builder.getInt8PtrTy());
-        builder.CreateCall(OriginMemInst, {Dest, Src, Size});
+        Size = builder.CreateZExtOrTrunc(Size, builder.getInt64Ty());
+
+        // Small fixed-size copies use the inlinable fast path, if linked in:
+        Function *Inline = M->getFunction("__rezzan_memcpy_inline");
+        ConstantInt *Len = dyn_cast<ConstantInt>(Size);
+        if (Inline != nullptr && !Inline->isDeclaration() &&
+                Inline->arg_size() == 4 && Len != nullptr &&
+                Len->getZExtValue() <= INLINE_MAX)
+            builder.CreateCall(Inline, {Dest, Src, Size,
+                builder.getInt64(ReZZan::nonce_size)});
+        else
+            builder.CreateCall(OriginMemInst, {Dest, Src, Size});
         dels.push_back(MemInst);
     }
 }
@@ -556,23 +1566,97 @@ static size_t get_config(const char *name, size_t _default)
 }
 
 
+/*
+ * Read a list of protection scopes, e.g., "heap,stack".
+ */
+static unsigned get_scopes(const char *name, unsigned _default)
+{
+    const char *str = getenv(name);
+    if (str == NULL)
+        return _default;
+    unsigned scopes = 0;
+    for (StringRef Rest(str); !Rest.empty(); )
+    {
+        StringRef Scope;
+        std::tie(Scope, Rest) = Rest.split(',');
+        if (Scope == "heap")
+            scopes |= SCOPE_HEAP;
+        else if (Scope == "stack")
+            scopes |= SCOPE_STACK;
+        else if (Scope == "global" || Scope == "globals")
+            scopes |= SCOPE_GLOBAL;
+        else if (Scope == "all")
+            scopes |= SCOPE_ALL;
+        else if (!Scope.empty())
+            errs()<<"failed to parse string \""<<str<<"\" into a list of scopes; "
+                "expected heap, stack, global, or all";
+    }
+    return scopes;
+}
+
+/*
+ * Count the instructions of the instrumented functions (REZZAN_REPORT).
+ */
+static size_t countInsts(const Module &M)
+{
+    size_t n = 0;
+    for (const auto &F : M)
+        if (!isRuntime(F))
+            n += F.getInstructionCount();
+    return n;
+}
+
 /*
  * Entry.
  */
 bool ReZZan::runOnModule(Module &M)
 {
-    uint16_t alloca_num = 0;
-    uint16_t global_num = 0;
-    uint16_t heap_num = 0;
+    size_t alloca_num = 0;
+    size_t global_num = 0;
+    size_t heap_num = 0;
+    size_t loop_num = 0;
+    size_t inst_num = countInsts(M);
 
     nonce_size = get_config("REZZAN_NONCE_SIZE", 61);
+    lowfat = (bool)get_config("REZZAN_LOWFAT", 0);
+    scopes = get_scopes("REZZAN_SCOPES", SCOPE_ALL);
+    groups = get_config("REZZAN_GROUPS", 0);
+    check_gep = (bool)get_config("REZZAN_CHECK_GEP", 0);
+    nonce_imm = (bool)get_config("REZZAN_NONCE_IMM", 0);
+    inline_check = (bool)get_config("REZZAN_INLINE_CHECK", 0);
+    loop_version = (bool)get_config("REZZAN_LOOP_VERSION", 0);
+    traps.clear();
+    if (groups > GROUPS_MAX)
+    {
+        errs()<<"invalid number of check groups ("<<groups<<"); must be at most "
+            <<GROUPS_MAX;
+        groups = GROUPS_MAX;
+    }
+
+    // Each module gets its own copy of the runtime fast paths:
+    for (auto &F : M)
+        if (isRuntime(F) && !F.isDeclaration())
+            F.setLinkage(GlobalValue::InternalLinkage);
 
     {
         std::vector<Instruction *> dels;
         for (auto &F : M)
+        {
+            if (isRuntime(F) || !(scopes & SCOPE_STACK))
+                continue;
             for (auto &BB: F)
                 for (auto &I: BB)
-                    replaceAlloca(&M, &I, dels);
+                    if (auto *Alloca = dyn_cast<AllocaInst>(&I))
+                        if (Alloca->isStaticAlloca())
+                            replaceAlloca(&M, &I, dels);
+            // Dynamic allocas (VLAs in loops get reusable regions):
+            if (!replaceRegionAllocas(&M, F, dels))
+                for (auto &BB: F)
+                    for (auto &I: BB)
+                        if (auto *Alloca = dyn_cast<AllocaInst>(&I))
+                            if (!Alloca->isStaticAlloca())
+                                replaceAlloca(&M, &I, dels);
+        }
         alloca_num += dels.size();
         for (auto *I: dels)
             I->eraseFromParent();
@@ -580,34 +1664,91 @@ bool ReZZan::runOnModule(Module &M)
 
     std::vector<Constant *> Metadata_gbl_overflow;
     std::vector<Constant *> Metadata_gbl_underflow;
+    std::vector<GlobalVariable *> consts;
     {
         std::vector<GlobalVariable *> dels;
-        for (auto &GV: M.getGlobalList())
-            replaceGlobal(&M, &GV, Metadata_gbl_overflow, Metadata_gbl_underflow, dels);
+        if (scopes & SCOPE_GLOBAL)
+            for (auto &GV: M.getGlobalList())
+                replaceGlobal(&M, &GV, Metadata_gbl_overflow, Metadata_gbl_underflow, dels, consts);
         global_num += dels.size();
         for (auto *V: dels)
             V->eraseFromParent();
+
+        // Globals are emitted in order, so moving the constants last keeps
+        // them together in the section:
+        for (auto *V: consts)
+        {
+            V->removeFromParent();
+            M.getGlobalList().push_back(V);
+        }
     }
 
+    // Tell the runtime which scopes to protect, and how many check groups:
+    Type *Int32Ty = Type::getInt32Ty(M.getContext());
+    if (scopes != SCOPE_ALL && M.getNamedValue("__rezzan_scopes") == nullptr)
+        new GlobalVariable(M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+            ConstantInt::get(Int32Ty, scopes), "__rezzan_scopes");
+    if (groups != 0 && M.getNamedValue("__rezzan_groups") == nullptr)
+        new GlobalVariable(M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+            ConstantInt::get(Int32Ty, groups), "__rezzan_groups");
+
     for (auto &F : M)
+    {
+        if (isRuntime(F))
+            continue;
+        std::vector<GEPCheck> Plans;
+        std::set<Instruction *> Covered;
+        if (loop_version && !F.isDeclaration() && !isCold(F))
+            loop_num += versionLoops(&M, F, Covered);
+        if (check_gep)
+            for (auto &BB: F)
+                for (auto &I: BB)
+                    if (auto *GEP = dyn_cast<GetElementPtrInst>(&I))
+                    {
+                        GEPCheck Plan;
+                        if (planGEPCheck(&M, GEP, Plan, Covered))
+                            Plans.push_back(Plan);
+                    }
+        std::vector<Instruction *> Accesses;   // insertCheck() may split blocks
         for (auto &BB: F)
             for (auto &I: BB)
-                heap_num += insertCheck(&M, &I) ? 1 : 0;
+                if ((isa<LoadInst>(&I) || isa<StoreInst>(&I)) &&
+                        Covered.count(&I) == 0)
+                    Accesses.push_back(&I);
+        for (const auto &Plan: Plans)
+            heap_num += insertGEPCheck(&M, Plan);
+        for (auto *I: Accesses)
+            heap_num += insertCheck(&M, I) ? 1 : 0;
+    }
 
     {
         std::vector<Instruction *> dels;
         for (auto &F : M)
-            for (auto &BB: F)
-                for (auto &I: BB)
-                    replaceMemInst(&M, &I, dels);
+            if (!isRuntime(F))
+                for (auto &BB: F)
+                    for (auto &I: BB)
+                        replaceMemInst(&M, &I, dels);
         for (auto *I: dels)
             I->eraseFromParent();
     }
 
     buildCheck(&M);
-    buildInit(&M, Metadata_gbl_overflow, Metadata_gbl_underflow);
+    buildInit(&M, Metadata_gbl_overflow, Metadata_gbl_underflow, consts);
+    if (nonce_imm)
+        buildNoncePatch(&M);
 
-    //errs() << alloca_num << " " << global_num << " " << heap_num << "\n";
+    if (getenv("REZZAN_REPORT") != nullptr)
+    {
+        size_t inline_num = 0;
+        for (const auto &Entry: traps)
+            inline_num += Entry.second.next;
+        errs() << "rezzan: " << M.getName() << ": " << heap_num << " checks ("
+            << inline_num << " inline, " << heap_num - inline_num
+            << " calls, " << traps.size() << " trap blocks), " << loop_num
+            << " versioned loops, " << alloca_num
+            << " stack objects, " << global_num << " globals; "
+            << inst_num << " -> " << countInsts(M) << " instructions\n";
+    }
 
     if (getenv("REZZAN_DEBUG") != nullptr)
     {
@@ -0,0 +1,331 @@
+/*
+ *
+ *   ReZZan allocation trace replay.
+ *   Replays traces recorded with REZZAN_TRACE against the allocator of
+ *      this process: glibc by default, or ReZZan with -r librezzan.so.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define error(msg, ...)                                                 \
+    do                                                                  \
+    {                                                                   \
+        fprintf(stderr, "error: " msg "\n", ##__VA_ARGS__);             \
+        exit(EXIT_FAILURE);                                             \
+    }                                                                   \
+    while (false)
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE   ((size_t)4096)
+#endif
+
+/*
+ * Trace format.  Must match rezzan_runtime.c.
+ */
+#define TRACE_MAGIC     "RZTRACE1"
+enum
+{
+    TRACE_MALLOC = 1,
+    TRACE_FREE,
+    TRACE_REALLOC,
+    TRACE_CALLOC,
+};
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+typedef struct
+{
+    uint8_t  op;
+    uint8_t  thread;
+    uint16_t reserved;
+    uint32_t time;
+    uint64_t size;
+    uint64_t ptr;
+    uint64_t old;
+} TraceRecord;
+
+/*
+ * Live objects, keyed by their address in the recorded exec.
+ */
+typedef struct
+{
+    uint64_t key;           // 0 = empty, 1 = deleted
+    void    *ptr;
+    size_t   size;
+} Object;
+static Object *objects  = NULL;
+static size_t  capacity = 0;
+
+static Object *object_find(uint64_t key, bool insert)
+{
+    size_t i = (key * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+    Object *tomb = NULL;
+    for (size_t n = 0; n < capacity; n++, i = (i + 1) & (capacity - 1))
+    {
+        Object *obj = objects + i;
+        if (obj->key == key)
+            return obj;
+        if (obj->key == 1 && tomb == NULL)
+            tomb = obj;
+        if (obj->key == 0)
+            return (!insert? NULL: tomb != NULL? tomb: obj);
+    }
+    return (insert? tomb: NULL);
+}
+
+/*
+ * Replay statistics.
+ */
+typedef struct
+{
+    size_t execs;
+    size_t ops[TRACE_CALLOC + 1];
+    size_t unmatched;
+    size_t leftover;
+    size_t live;
+    size_t peak;
+    double time;
+} Stats;
+
+static bool option_write = false;
+
+static void touch(void *ptr, size_t size)
+{
+    if (ptr == NULL || size == 0)
+        return;
+    uint8_t *ptr8 = (uint8_t *)ptr;
+    if (option_write)
+    {
+        memset(ptr8, 0xaa, size);
+        return;
+    }
+    for (size_t i = 0; i < size; i += PAGE_SIZE)
+        ptr8[i] = 0xaa;
+    ptr8[size - 1] = 0xaa;
+}
+
+static void object_insert(Stats *stats, uint64_t key, void *ptr, size_t size)
+{
+    Object *obj = object_find(key, true);
+    if (obj == NULL)
+        error("too many live objects");
+    if (obj->key == key)
+    {
+        // Never freed in the recorded exec (e.g., via an uninterposed
+        // path), so forget it:
+        stats->live -= obj->size;
+        stats->unmatched++;
+    }
+    obj->key  = key;
+    obj->ptr  = ptr;
+    obj->size = size;
+    stats->live += size;
+    stats->peak = (stats->live > stats->peak? stats->live: stats->peak);
+}
+
+static void *object_remove(Stats *stats, uint64_t key)
+{
+    Object *obj = object_find(key, false);
+    if (obj == NULL)
+    {
+        stats->unmatched++;
+        return NULL;
+    }
+    obj->key = 1;
+    stats->live -= obj->size;
+    return obj->ptr;
+}
+
+/*
+ * Free everything that is still live at the end of an exec.
+ */
+static void reset(Stats *stats)
+{
+    for (size_t i = 0; i < capacity; i++)
+    {
+        if (objects[i].key > 1)
+        {
+            free(objects[i].ptr);
+            stats->leftover++;
+        }
+        objects[i].key = 0;
+    }
+    stats->live = 0;
+}
+
+/*
+ * Replay one trace file.
+ */
+static void replay(const char *filename, Stats *stats)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        error("failed to open \"%s\": %s", filename, strerror(errno));
+    struct stat buf;
+    if (fstat(fd, &buf) < 0)
+        error("failed to stat \"%s\": %s", filename, strerror(errno));
+    size_t size = buf.st_size;
+    if (size < sizeof(TraceHeader))
+        error("invalid trace \"%s\"; file is too small", filename);
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ,
+        MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED)
+        error("failed to map \"%s\": %s", filename, strerror(errno));
+    close(fd);
+
+    size_t nrecords = size / sizeof(TraceRecord);
+    for (capacity = 1024; capacity < 2 * nrecords; capacity *= 2)
+        ;
+    objects = (Object *)calloc(capacity, sizeof(Object));
+    if (objects == NULL)
+        error("failed to allocate object table: %s", strerror(errno));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < size; )
+    {
+        const TraceHeader *hdr = (const TraceHeader *)(data + i);
+        if (i + sizeof(TraceHeader) <= size &&
+                memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) == 0)
+        {
+            if (hdr->record_size != sizeof(TraceRecord))
+                error("invalid trace \"%s\"; unsupported record size %u",
+                    filename, hdr->record_size);
+            if (stats->execs++ > 0)
+                reset(stats);
+            i += sizeof(TraceHeader);
+            continue;
+        }
+        if (stats->execs == 0 || i + sizeof(TraceRecord) > size)
+            error("invalid trace \"%s\"; bad record at offset %zu",
+                filename, i);
+        const TraceRecord *record = (const TraceRecord *)(data + i);
+        i += sizeof(TraceRecord);
+        void *ptr;
+        switch (record->op)
+        {
+            case TRACE_MALLOC:
+                ptr = malloc(record->size);
+                touch(ptr, record->size);
+                object_insert(stats, record->ptr, ptr, record->size);
+                break;
+            case TRACE_CALLOC:
+                ptr = calloc(1, record->size);
+                touch(ptr, record->size);
+                object_insert(stats, record->ptr, ptr, record->size);
+                break;
+            case TRACE_FREE:
+                free(object_remove(stats, record->ptr));
+                break;
+            case TRACE_REALLOC:
+                ptr = object_remove(stats, record->old);
+                ptr = realloc(ptr, record->size);
+                touch(ptr, record->size);
+                object_insert(stats, record->ptr, ptr, record->size);
+                break;
+            default:
+                error("invalid trace \"%s\"; bad operation %u at offset %zu",
+                    filename, record->op, i - sizeof(TraceRecord));
+        }
+        stats->ops[record->op]++;
+    }
+    reset(stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->time += (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    free(objects);
+    objects = NULL;
+    munmap((void *)data, size);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-r librezzan.so] [-n runs] [-w] trace...\n\n"
+        "  -r lib  replay against the allocator in lib (LD_PRELOAD)\n"
+        "  -n N    replay every trace N times (default: 1)\n"
+        "  -w      write whole objects (default: one byte per page)\n",
+        progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *preload = NULL;
+    size_t runs = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:n:w")) > 0)
+    {
+        switch (opt)
+        {
+            case 'r':
+                preload = optarg;
+                break;
+            case 'n':
+                runs = (size_t)strtoull(optarg, NULL, 0);
+                if (runs == 0)
+                    usage(argv[0]);
+                break;
+            case 'w':
+                option_write = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    // Re-exec with the requested allocator:
+    if (preload != NULL && getenv("REZZAN_REPLAY_PRELOADED") == NULL)
+    {
+        setenv("LD_PRELOAD", preload, true);
+        setenv("REZZAN_STATS", "1", false);
+        unsetenv("REZZAN_TRACE");
+        setenv("REZZAN_REPLAY_PRELOADED", "1", true);
+        execv("/proc/self/exe", argv);
+        error("failed to execute \"%s\": %s", argv[0], strerror(errno));
+    }
+
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (size_t run = 0; run < runs; run++)
+        for (int i = optind; i < argc; i++)
+            replay(argv[i], &stats);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        error("failed to get resource usage: %s", strerror(errno));
+    size_t ops = stats.ops[TRACE_MALLOC] + stats.ops[TRACE_CALLOC] +
+        stats.ops[TRACE_REALLOC] + stats.ops[TRACE_FREE];
+    printf("allocator       = %s\n", (preload != NULL? preload: "default"));
+    printf("execs           = %zu\n", stats.execs);
+    printf("ops             = %zu (malloc=%zu, calloc=%zu, realloc=%zu, "
+        "free=%zu)\n", ops, stats.ops[TRACE_MALLOC], stats.ops[TRACE_CALLOC],
+        stats.ops[TRACE_REALLOC], stats.ops[TRACE_FREE]);
+    printf("unmatched       = %zu\n", stats.unmatched);
+    printf("leftover        = %zu objects\n", stats.leftover);
+    printf("peak live       = %zu bytes\n", stats.peak);
+    printf("time            = %.3f s (%.0f ops/s)\n", stats.time,
+        (stats.time > 0.0? ops / stats.time: 0.0));
+    printf("maxrss          = %zu bytes\n", usage.ru_maxrss * 1024);
+    fflush(stdout);
+    return 0;
+}
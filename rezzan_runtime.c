@@ -19,8 +19,15 @@
 #include <stdarg.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <ucontext.h>
 #include <sys/syscall.h>
 #include <sys/resource.h>
+#include <sys/shm.h>
 
 #define REZZAN_ALIAS(X)     __attribute__((__alias__(X)))
 #define REZZAN_CONSTRUCTOR  __attribute__((__constructor__(101)))
@@ -33,6 +40,29 @@ static bool option_checks   = false;
 static bool option_tty      = false;
 static bool option_stats    = false;
 static bool option_populate = false;
+static bool option_prezero  = false;
+static bool option_no_reuse = false;
+static bool option_fast_exit = false;
+static bool option_leaks     = false;
+static bool option_lowfat    = false;
+static bool option_regions   = false;
+static bool option_heap      = false;   // ReZZan allocation (see SCOPE_HEAP)
+static bool exiting          = false;   // See exit_begin()
+
+static const char *error_msg = NULL;
+
+/*
+ * Protection scopes (REZZAN_SCOPES).  The pass only wraps the objects of the
+ * enabled scopes, and records its scopes in __rezzan_scopes if not all are
+ * enabled.
+ */
+#define SCOPE_HEAP      0x1
+#define SCOPE_STACK     0x2
+#define SCOPE_GLOBAL    0x4
+#define SCOPE_ALL       (SCOPE_HEAP | SCOPE_STACK | SCOPE_GLOBAL)
+
+static unsigned option_scopes = SCOPE_ALL;
+extern const unsigned __rezzan_scopes __attribute__((__weak__));
 
 #define DEBUG(msg, ...)                                                 \
     do                                                                  \
@@ -53,14 +83,24 @@ static bool option_populate = false;
             (option_tty? "\33[0m" : ""),                                \
             __FILE__, __LINE__,                                         \
             ##__VA_ARGS__);                                             \
+        error_msg = (msg);                                              \
         asm ("ud2");                                                    \
     }                                                                   \
     while (false)
+#define warning(msg, ...)                                               \
+    fprintf(stderr, "%swarning%s: %s: %u: " msg "\n",                   \
+        (option_tty? "\33[33m": ""),                                    \
+        (option_tty? "\33[0m" : ""),                                    \
+        __FILE__, __LINE__,                                             \
+        ##__VA_ARGS__)
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE   ((size_t)4096)
 #endif
-#define POOL_SIZE   ((size_t)(1ull << 31))      // 2GB
+#define POOL_BASE   ((void *)0xaaa00000000)
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
 #define NONCE_ADDR  ((void *)0x10000)
 
@@ -88,12 +128,13 @@ struct Unit
 typedef struct Unit Unit;
 
 /*
- * Quarantine free list node.
+ * Quarantine free list node.  Offsets are 64-bit since the pool can grow
+ * beyond 2^32 units.
  */
 struct FreeNode
 {
-    uint32_t ptr128;
-    uint32_t size128;
+    uint64_t ptr128;
+    uint64_t size128;
     struct FreeNode *next;
 };
 typedef struct FreeNode FreeNode;
@@ -113,7 +154,10 @@ typedef struct Entry Entry;
  */
 static size_t nonce_size      = 0;
 static size_t quarantine_size = 0;
-static size_t pool_size       = 0;
+static size_t pool_size       = 0;     // 0 = no limit
+static size_t remap_size      = 0;     // 0 = never
+static size_t no_reuse_limit  = 0;
+static size_t leak_budget     = 0;     // ms, 0 = no limit
 
 /*
  * Multi-threading.
@@ -121,13 +165,165 @@ static size_t pool_size       = 0;
 static pthread_mutex_t malloc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
- * Malloc memory pool.
+ * Malloc memory pool.  The pool grows upwards from POOL_BASE, one segment
+ * of at least POOL_MMAP_SIZE units at a time.  Segments are chained
+ * contiguously, so pool membership is a single range test.
  */
 static Unit  *pool      = NULL;
 static size_t pool_ptr  = 0;
 static size_t pool_mmap = 0;
 #define POOL_MMAP_SIZE          (((size_t)(1ull << 15)) / sizeof(Unit))
 
+/*
+ * Test if `ptr' was allocated from the pool.
+ */
+static inline bool pool_contains(const void *ptr)
+{
+    const Unit *ptr128 = (const Unit *)ptr;
+    return (ptr128 >= pool && ptr128 < pool + pool_ptr);
+}
+
+/*
+ * Low-fat heap (REZZAN_LOWFAT).  Small objects are allocated from one region
+ * per power-of-two size class, in slots aligned to their size, so the base
+ * and size of an object follow from the pointer value alone:
+ *
+ *      class = (ptr - LOWFAT_BASE) >> LOWFAT_REGION_SHIFT
+ *      size  = 16 << class
+ *      base  = ptr & -size
+ *
+ * The instrumentation uses this for arithmetic bounds checks.  The slots
+ * are still delimited by tokens, so all other checks work as before.  The
+ * layout must match rezzan_instrument.cpp.
+ */
+#define LOWFAT_BASE             ((uintptr_t)0x100000000000ull)
+#define LOWFAT_REGION_SHIFT     36
+#define LOWFAT_CLASSES          17      // 16 bytes .. 1MB
+static size_t lowfat_ptr[LOWFAT_CLASSES]        = {0};  // In bytes
+static size_t lowfat_mmap[LOWFAT_CLASSES]       = {0};  // In bytes
+static Entry  lowfat_quarantine[LOWFAT_CLASSES] = {{NULL, NULL}};
+static size_t lowfat_usage                      = 0;
+
+/*
+ * Test if `ptr' was allocated from the low-fat heap.
+ */
+static inline bool lowfat_contains(const void *ptr)
+{
+    size_t i = ((uintptr_t)ptr - LOWFAT_BASE) >> LOWFAT_REGION_SHIFT;
+    uintptr_t offset = (uintptr_t)ptr & ((1ull << LOWFAT_REGION_SHIFT) - 1);
+    return (i < LOWFAT_CLASSES && offset < lowfat_ptr[i]);
+}
+
+/*
+ * The base of the low-fat object pointed to by `ptr'.
+ */
+static inline void *lowfat_base(const void *ptr)
+{
+    size_t i = ((uintptr_t)ptr - LOWFAT_BASE) >> LOWFAT_REGION_SHIFT;
+    return (void *)((uintptr_t)ptr & -(sizeof(Unit) << i));
+}
+
+/*
+ * The slot size of the low-fat object pointed to by `ptr', in words.
+ */
+static inline size_t lowfat_size64(const void *ptr)
+{
+    size_t i = ((uintptr_t)ptr - LOWFAT_BASE) >> LOWFAT_REGION_SHIFT;
+    return (sizeof(Unit) / sizeof(Token)) << i;
+}
+
+/*
+ * Test if `ptr' was allocated by us.
+ */
+static inline bool heap_contains(const void *ptr)
+{
+    return pool_contains(ptr) || lowfat_contains(ptr);
+}
+
+/*
+ * Token page map.  One bit per heap page, set before a token is written to
+ * the page, and only cleared once the whole page has been zeroed.  A clear
+ * bit therefore means the page holds no tokens, and range checks can skip
+ * it.  The map covers the pool and the low-fat regions, and is mapped
+ * piecewise as they grow.  Stack and global memory is not covered (the
+ * instrumentation writes its tokens directly), and is always scanned.
+ */
+#define TOKEN_MAP_BASE          ((uint8_t *)0x9a000000000ull)
+#define TOKEN_MAP_MIN           (2 * PAGE_SIZE)     // Smaller is scanned
+
+static inline size_t token_map_page(const void *ptr)
+{
+    return ((uintptr_t)ptr - (uintptr_t)POOL_BASE) / PAGE_SIZE;
+}
+
+/*
+ * Map the part of the map covering the heap memory [lo, hi).
+ */
+static void token_map_grow(const void *lo, const void *hi)
+{
+    uintptr_t start = (uintptr_t)(TOKEN_MAP_BASE + token_map_page(lo) / 8);
+    uintptr_t end   = (uintptr_t)(TOKEN_MAP_BASE +
+        (token_map_page((const uint8_t *)hi - 1) / 8) + 1);
+    start &= ~(PAGE_SIZE - 1);
+    end    = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (; start < end; start += PAGE_SIZE)
+    {
+        // Pages shared with an earlier range may already be mapped:
+        void *ptr = mmap((void *)start, PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (ptr == (void *)start)
+            continue;
+        if (ptr != MAP_FAILED)
+            (void)munmap(ptr, PAGE_SIZE);
+        else if (errno == EEXIST)
+            continue;
+        error("failed to allocate token page map at %p: %s", (void *)start,
+            (ptr == MAP_FAILED? strerror(errno): "address in use"));
+    }
+}
+
+static inline void token_map_set(const void *ptr)
+{
+    size_t page = token_map_page(ptr);
+    uint8_t *map = TOKEN_MAP_BASE + page / 8, bit = 1 << (page % 8);
+    if ((*map & bit) == 0)
+        __atomic_fetch_or(map, bit, __ATOMIC_RELAXED);
+}
+
+static inline bool token_map_test(const void *ptr)
+{
+    size_t page = token_map_page(ptr);
+    return (TOKEN_MAP_BASE[page / 8] & (1 << (page % 8))) != 0;
+}
+
+/*
+ * Clear the pages wholly inside [lo, hi), which must be all zeros.
+ */
+static void token_map_clear(const void *lo, const void *hi)
+{
+    uintptr_t start = ((uintptr_t)lo + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t end   = (uintptr_t)hi & ~(PAGE_SIZE - 1);
+    for (; start < end; start += PAGE_SIZE)
+    {
+        size_t page = token_map_page((const void *)start);
+        uint8_t *map = TOKEN_MAP_BASE + page / 8, bit = 1 << (page % 8);
+        if ((*map & bit) != 0)
+            __atomic_fetch_and(map, (uint8_t)~bit, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Test if the token page map covers [lo, hi).
+ */
+static inline bool token_map_covers(const void *lo, const void *hi)
+{
+    const uint8_t *last = (const uint8_t *)hi - 1;
+    if (pool_contains(lo))
+        return pool_contains(last);
+    return lowfat_contains(lo) && lowfat_contains(last) &&
+        lowfat_base(lo) == lowfat_base(last);
+}
+
 /*
  * Quarantine.
  */
@@ -138,7 +334,104 @@ static size_t    quarantine_mmap      = 0;
 static FreeNode *quarantine_free      = NULL;
 static Entry     quarantine[20]       = {{NULL, NULL}};
 static size_t quarantine_usage        = 0;
-#define QUARANTINE_MMAP_SIZE    ((2 * PAGE_SIZE) / sizeof(FreeNode))
+#define QUARANTINE_MMAP_SIZE    (2 * PAGE_SIZE)     // In nodes, page-aligned
+
+/*
+ * Pre-zeroed chunks (REZZAN_PREZERO).  A background worker moves chunks that
+ * are due to leave the quarantine into per-size-class "ready" lists, already
+ * zeroed except for the final token, so recycling them costs no more than a
+ * fresh pool allocation.
+ */
+static Entry           ready[20]     = {{NULL, NULL}};
+static size_t          ready_usage   = 0;
+static size_t          ready_limit   = 0;
+static pthread_cond_t  worker_cond   = PTHREAD_COND_INITIALIZER;
+static bool            worker_active = false;
+#define READY_LIMIT_MIN         ((size_t)(1ull << 20) / sizeof(Unit))
+
+/*
+ * Comparison tokens shared with afl-fuzz (AFL_REZZAN_DICT).  The layout must
+ * match `struct rezzan_dict' in afl-fuzz.c.
+ */
+#define DICT_ENV_VAR    "__AFL_REZZAN_DICT_SHM_ID"
+#define DICT_MAX        512                 // REZZAN_DICT_MAX
+#define DICT_SEEN       (1 << 16)           // REZZAN_DICT_SEEN
+#define DICT_LEN_MIN    3                   // MIN_AUTO_EXTRA
+#define DICT_LEN_MAX    32                  // MAX_AUTO_EXTRA
+
+struct DictEntry
+{
+    uint8_t len;
+    uint8_t data[DICT_LEN_MAX];
+};
+typedef struct DictEntry DictEntry;
+
+struct Dict
+{
+    uint32_t  count;
+    uint8_t   seen[DICT_SEEN / 8];
+    DictEntry tokens[DICT_MAX];
+};
+typedef struct Dict Dict;
+
+static Dict *dict = NULL;
+
+/*
+ * Where the constants are: the read-only mappings of the main executable,
+ * and the constants (e.g., string literals) that the pass wraps into the
+ * writable __rezzan_gbls sections, which each module registers.  Writable
+ * data may hold the input itself, so it is not a source of tokens.  Sorted
+ * and merged, so that lookups are a binary search; the table moves to an
+ * mmap()ed one when it fills up.
+ */
+#define DICT_RANGE_INIT 256
+
+typedef struct
+{
+    uintptr_t lo;
+    uintptr_t hi;
+} DictRange;
+
+static DictRange       dict_ranges_init[DICT_RANGE_INIT];
+static DictRange      *dict_ranges      = dict_ranges_init;
+static size_t          dict_range_count = 0;
+static size_t          dict_range_max   = DICT_RANGE_INIT;
+static pthread_mutex_t dict_mutex       = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Fault record shared with afl-triage.  The layout must match `struct
+ * rezzan_triage' in afl-triage.c.
+ */
+#define TRIAGE_ENV_VAR  "__AFL_REZZAN_TRIAGE_SHM_ID"
+#define TRIAGE_FRAMES   5
+#define TRIAGE_SCAN_MAX 4096
+
+struct Triage
+{
+    uint32_t valid;
+    uint32_t signal;
+    uint64_t site;
+    uint64_t stack_hash;
+    char     what[64];
+};
+typedef struct Triage Triage;
+
+static Triage   *triage       = NULL;
+static void     *runtime_base = NULL;
+
+/*
+ * Extent of the main executable's image, and the top of the main stack.
+ */
+static uintptr_t image_lo = 0;
+static uintptr_t image_hi = 0;
+static uintptr_t stack_hi = 0;
+
+/*
+ * Threads started through pthread_create() that are still running (their
+ * stacks are registered as regions first), and if the current one is such.
+ */
+static size_t          thread_count   = 0;
+static __thread bool   thread_started = false;
 
 static FreeNode *quarantine_node_alloc(void)
 {
@@ -156,7 +449,7 @@ static FreeNode *quarantine_node_alloc(void)
             -1, 0);
         if (ptr != start)
             error("failed to allocate %zu bytes for malloc pool: %s",
-                QUARANTINE_MMAP_SIZE, strerror(errno));
+                QUARANTINE_MMAP_SIZE * sizeof(FreeNode), strerror(errno));
         quarantine_mmap += QUARANTINE_MMAP_SIZE;
     }
     if (quarantine_ptr >= quarantine_pool_size)
@@ -251,6 +544,7 @@ asm (
  */
 static void poison(Token *ptr64, size_t size)
 {
+    token_map_set(ptr64);
     switch (nonce_size)
     {
         case 61:
@@ -272,6 +566,32 @@ static void zero(Token *ptr64)
     rezzan_zero_token(ptr64);
 }
 
+/*
+ * Zero the words [start64, end64).  For large ranges, the whole pages are
+ * dropped instead, and the kernel supplies zero pages on the next touch.
+ */
+static void zero_range(Token *start64, Token *end64)
+{
+    Token *lo64 = end64, *hi64 = end64;
+    size_t size = (uint8_t *)end64 - (uint8_t *)start64;
+    if (remap_size != 0 && size >= remap_size)
+    {
+        lo64 = (Token *)(((uintptr_t)start64 + PAGE_SIZE - 1) &
+            ~(PAGE_SIZE - 1));
+        hi64 = (Token *)((uintptr_t)end64 & ~(PAGE_SIZE - 1));
+        if (hi64 <= lo64 ||
+                madvise(lo64, (uint8_t *)hi64 - (uint8_t *)lo64,
+                    MADV_DONTNEED) < 0)
+            lo64 = hi64 = end64;
+    }
+    Token *begin64 = start64;
+    for (; start64 < lo64; start64++)
+        zero(start64);
+    for (start64 = hi64; start64 < end64; start64++)
+        zero(start64);
+    token_map_clear(begin64, end64);
+}
+
 /*
  * Test if the 64-bit aligned pointer `ptr64' is poisoned or not.
  */
@@ -286,24 +606,128 @@ static bool is_poisoned(Token *ptr64)
     }
 }
 
+/*
+ * Memory regions that may hold tokens besides the heap: the stacks (where
+ * instrumented functions wrap their locals) and the __rezzan_gbls sections
+ * of the instrumented modules.  The interceptors need not scan memory
+ * outside the heap and these regions (glibc's heap, mapped files, libc's
+ * internal buffers), as it never holds tokens.  Entries are never moved, and
+ * are freed by zeroing `hi', so readers need no lock.
+ */
+#define REGION_MAX      256
+
+typedef struct
+{
+    uintptr_t lo;
+    uintptr_t hi;
+} Region;
+
+static Region          regions[REGION_MAX];
+static size_t          region_count = 0;
+static bool            region_full  = false;    // Scan everything
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t region_add(uintptr_t lo, uintptr_t hi)
+{
+    if (lo >= hi)
+        return -1;
+    ssize_t slot = -1;
+    pthread_mutex_lock(&region_mutex);
+    for (size_t i = 0; i < region_count; i++)
+    {
+        if (regions[i].lo == lo && regions[i].hi == hi)
+        {
+            // Every module of an image registers the same section:
+            pthread_mutex_unlock(&region_mutex);
+            return -1;
+        }
+        if (regions[i].hi == 0 && slot < 0)
+            slot = i;
+    }
+    if (slot < 0 && region_count < REGION_MAX)
+        slot = region_count;
+    if (slot < 0)
+        __atomic_store_n(&region_full, true, __ATOMIC_RELEASE);
+    else
+    {
+        regions[slot].lo = lo;
+        __atomic_store_n(&regions[slot].hi, hi, __ATOMIC_RELEASE);
+        if ((size_t)slot == region_count)
+            __atomic_store_n(&region_count, region_count + 1,
+                __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&region_mutex);
+    return slot;
+}
+
+static void region_remove(ssize_t slot)
+{
+    if (slot < 0)
+        return;
+    pthread_mutex_lock(&region_mutex);
+    __atomic_store_n(&regions[slot].hi, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&region_mutex);
+}
+
+/*
+ * Test if [ptr, ptr+n) may hold tokens.
+ */
+static bool region_tokens(const void *ptr, size_t n)
+{
+    if (!option_regions || __atomic_load_n(&region_full, __ATOMIC_ACQUIRE))
+        return true;
+    uintptr_t lo = (uintptr_t)ptr, hi = lo + n + sizeof(Token);
+    if (hi < lo)
+        return true;
+    if (option_heap && lo < (uintptr_t)(pool + pool_ptr) &&
+            hi > (uintptr_t)pool)
+        return true;
+    if (option_heap && lo < LOWFAT_BASE +
+            ((uintptr_t)LOWFAT_CLASSES << LOWFAT_REGION_SHIFT) &&
+            hi > LOWFAT_BASE)
+        return true;
+    size_t count = __atomic_load_n(&region_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; i++)
+    {
+        uintptr_t region_hi = __atomic_load_n(&regions[i].hi,
+            __ATOMIC_ACQUIRE);
+        if (lo < region_hi && hi > regions[i].lo)
+            return true;
+    }
+    return false;
+}
+
 /*
  * Checking the memory region start from ptr with n length if memory safe.
  */
-static bool check_poisoned(const void *ptr, size_t n)
+static void check_poisoned(const void *ptr, size_t n)
 {
+    if (!region_tokens(ptr, n))
+        return;
+
     // Check the token of the destination
     uintptr_t iptr = (uintptr_t)ptr;
     size_t front_delta = iptr % sizeof(Token);
-    int check_len = n + front_delta;
+    size_t check_len = n + front_delta;
     iptr -= front_delta;
     size_t end_delta = check_len % sizeof(Token);
     if (end_delta)
         check_len += sizeof(Token);
     check_len /= sizeof(Token);
     Token *ptr64 = (Token *)iptr;
+    bool map = (check_len * sizeof(Token) >= TOKEN_MAP_MIN &&
+        token_map_covers(ptr64, ptr64 + check_len));
     for (size_t i = 0; i < check_len; i++) // Check the token of each memory
+    {
+        if (map && (uintptr_t)(ptr64 + i) % PAGE_SIZE == 0 &&
+                !token_map_test(ptr64 + i))
+        {
+            i += PAGE_SIZE / sizeof(Token) - 1;     // No tokens in the page
+            continue;
+        }
         if (is_poisoned(ptr64 + i))
             asm ("ud2");
+    }
     if (end_delta && nonce_size == 61) {    // Check the token after the current memory for byte-accurate checking
         ptr64 += check_len;
         if ((uintptr_t)ptr64 % PAGE_SIZE != 0 && rezzan_test_token61((const Token *)ptr64))
@@ -335,6 +759,708 @@ static size_t get_config(const char *name, size_t _default)
     return val;
 }
 
+/*
+ * Read a list of protection scopes, e.g., "heap,stack".
+ */
+static unsigned get_scopes(const char *name, unsigned _default)
+{
+    const char *str = getenv(name);
+    if (str == NULL)
+        return _default;
+    unsigned scopes = 0;
+    while (*str != '\0')
+    {
+        size_t len = strcspn(str, ",");
+        if (len == 4 && strncmp(str, "heap", len) == 0)
+            scopes |= SCOPE_HEAP;
+        else if (len == 5 && strncmp(str, "stack", len) == 0)
+            scopes |= SCOPE_STACK;
+        else if ((len == 6 && strncmp(str, "global", len) == 0) ||
+                (len == 7 && strncmp(str, "globals", len) == 0))
+            scopes |= SCOPE_GLOBAL;
+        else if (len == 3 && strncmp(str, "all", len) == 0)
+            scopes |= SCOPE_ALL;
+        else if (len != 0)
+            error("failed to parse string \"%s\" into a list of scopes; "
+                "expected heap, stack, global, or all", str);
+        str += len + (str[len] == ','? 1: 0);
+    }
+    return scopes;
+}
+
+/*
+ * Find the first range with `hi' above `ptr' (dict_mutex held).
+ */
+static size_t dict_range_find(uintptr_t ptr)
+{
+    size_t lo = 0, hi = dict_range_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dict_ranges[mid].hi <= ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Add [lo, hi), merged with the ranges that it overlaps or touches.  Must
+ * not malloc() (see find_image()).
+ */
+static void dict_range_add(uintptr_t lo, uintptr_t hi)
+{
+    if (lo >= hi)
+        return;
+    pthread_mutex_lock(&dict_mutex);
+    size_t i = (lo == 0? 0: dict_range_find(lo - 1)), j = i;
+    while (j < dict_range_count && dict_ranges[j].lo <= hi)
+    {
+        lo = (dict_ranges[j].lo < lo? dict_ranges[j].lo: lo);
+        hi = (dict_ranges[j].hi > hi? dict_ranges[j].hi: hi);
+        j++;
+    }
+    if (i == j && dict_range_count == dict_range_max)
+    {
+        size_t max = 2 * dict_range_max;
+        DictRange *ranges = (DictRange *)mmap(NULL, max * sizeof(DictRange),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ranges == MAP_FAILED)
+        {
+            static bool warned = false;
+            if (!warned)
+                warning("failed to grow the constant range table: %s; "
+                    "constants of later modules are not recorded as "
+                    "comparison tokens", strerror(errno));
+            warned = true;
+            pthread_mutex_unlock(&dict_mutex);
+            return;
+        }
+        for (size_t k = 0; k < dict_range_count; k++)
+            ranges[k] = dict_ranges[k];
+        if (dict_ranges != dict_ranges_init)
+            (void)munmap(dict_ranges, dict_range_max * sizeof(DictRange));
+        dict_ranges    = ranges;
+        dict_range_max = max;
+    }
+    // Replace the merged ranges [i, j) with a single one at i:
+    size_t count = dict_range_count - (j - i) + 1;
+    if (i == j)
+        for (size_t k = dict_range_count; k > i; k--)
+            dict_ranges[k] = dict_ranges[k-1];
+    else
+        for (size_t k = i + 1; k < count; k++)
+            dict_ranges[k] = dict_ranges[k + (j - i) - 1];
+    dict_range_count = count;
+    dict_ranges[i].lo = lo;
+    dict_ranges[i].hi = hi;
+    pthread_mutex_unlock(&dict_mutex);
+}
+
+/*
+ * Called by the constructor of each instrumented module with constant
+ * globals, which the pass places together at the end of its __rezzan_gbls.
+ */
+extern void __rezzan_register_consts(void *lo, void *hi)
+{
+    dict_range_add((uintptr_t)lo, (uintptr_t)hi);
+}
+
+/*
+ * Find the extent of the main executable's image (and the top of the main
+ * thread's stack), and its read-only mappings.  Called from rezzan_init(),
+ * so it must not malloc().
+ */
+static void find_image(void)
+{
+    if (image_hi != 0)
+        return;
+    char exe[4096], buf[4096];
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exe_len <= 0)
+        return;
+    exe[exe_len] = '\0';
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd < 0)
+        return;
+
+    size_t len = 0;
+    while (true)
+    {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r <= 0)
+            break;
+        len += r;
+        buf[len] = '\0';
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = '\0';
+            char *path = strchr(line, '/');
+            char *end = NULL, *perms = NULL;
+            uintptr_t lo = (uintptr_t)strtoull(line, &end, 16);
+            uintptr_t hi = (uintptr_t)strtoull(end + 1, &perms, 16);
+            if (path == NULL && strstr(line, "[stack]") != NULL)
+                stack_hi = hi;
+            else if (path != NULL && strcmp(path, exe) == 0)
+            {
+                if (image_lo == 0 || lo < image_lo)
+                    image_lo = lo;
+                if (hi > image_hi)
+                    image_hi = hi;
+                if (perms[0] == ' ' && perms[1] == 'r' && perms[2] == '-')
+                    dict_range_add(lo, hi);
+            }
+            line = nl + 1;
+        }
+        len = (buf + len) - line;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = line[i];
+        if (len == sizeof(buf) - 1)
+            len = 0;        // Overlong line, skip it.
+    }
+    close(fd);
+}
+
+/*
+ * Register the main thread's stack.  Called from rezzan_init(), so it must
+ * not malloc().
+ */
+static void region_init(void)
+{
+    find_image();
+    if (!(option_scopes & SCOPE_STACK))
+        return;
+    struct rlimit limit;
+    if (stack_hi == 0 || getrlimit(RLIMIT_STACK, &limit) < 0)
+    {
+        region_full = true;
+        return;
+    }
+    const size_t STACK_MAX = (1ull << 32);
+    size_t size = (limit.rlim_cur == RLIM_INFINITY ||
+        limit.rlim_cur > STACK_MAX? STACK_MAX: limit.rlim_cur);
+    (void)region_add(stack_hi - size, stack_hi);
+}
+
+/*
+ * Called by the constructor of each instrumented module with globals.
+ */
+extern void __rezzan_register_globals(void *lo, void *hi)
+{
+    if (!(option_scopes & SCOPE_GLOBAL))
+        return;
+    (void)region_add((uintptr_t)lo, (uintptr_t)hi);
+}
+
+/*
+ * Called by the constructor of each instrumented module built with
+ * REZZAN_NONCE_IMM, to patch the nonce into the immediates of the check
+ * helpers.  Each entry of [lo, hi) is the offset from the entry to an
+ * immediate.
+ */
+extern void __rezzan_patch_nonce(void *lo, void *hi)
+{
+    if (!option_enabled)
+        return;                 // No nonce; the placeholder matches nothing
+    uint64_t nonce = *(const uint64_t *)NONCE_ADDR;
+    for (const int32_t *entry = (const int32_t *)lo;
+            entry < (const int32_t *)hi; entry++)
+    {
+        uint8_t *imm = (uint8_t *)entry + *entry;
+        uintptr_t page = (uintptr_t)imm & ~(PAGE_SIZE - 1);
+        size_t len = ((uintptr_t)imm + sizeof(nonce) - page + PAGE_SIZE - 1) &
+            ~(PAGE_SIZE - 1);
+        if (mprotect((void *)page, len, PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+            error("failed to patch the nonce at %p: %s", imm, strerror(errno));
+        __builtin_memcpy(imm, &nonce, sizeof(nonce));
+        (void)mprotect((void *)page, len, PROT_READ | PROT_EXEC);
+    }
+}
+
+/*
+ * Called by the loops versioned with REZZAN_LOOP_VERSION.  Returns an end
+ * such that no check of an access inside [ptr, end) can fail: the end of the
+ * object at `ptr' if it is near, or else the end of the token-free pages
+ * that follow.  Returns `ptr' itself if nothing is known (e.g., outside the
+ * heap), or if `ptr' is already past the object.
+ */
+#define CLEAN_SCAN_MAX      64                  // In words
+#define CLEAN_BOUND_MAX     (256 * PAGE_SIZE)
+extern uintptr_t __rezzan_clean_bound(const void *ptr)
+{
+    if (!heap_contains(ptr))
+        return (uintptr_t)ptr;
+
+    // The end of the object, if near:
+    Token *ptr64 = (Token *)((uintptr_t)ptr & ~(sizeof(Token) - 1));
+    uintptr_t page = ((uintptr_t)ptr64 + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+    Token *end64 = ptr64 + CLEAN_SCAN_MAX;
+    if ((uintptr_t)end64 > page)
+        end64 = (Token *)page;
+    uintptr_t end = (uintptr_t)end64;
+    uint64_t nonce = *(const uint64_t *)NONCE_ADDR;
+    uint64_t mask = (nonce_size == 61? ~(uint64_t)7: ~(uint64_t)0);
+    for (; ptr64 < end64; ptr64++)
+    {
+        if ((ptr64->nonce & mask) + nonce != 0)
+            continue;
+        end = (uintptr_t)ptr64;
+        if (nonce_size == 61 && ptr64->boundary != 0)
+            end -= sizeof(Token) - ptr64->boundary;
+        return (end < (uintptr_t)ptr? (uintptr_t)ptr: end);
+    }
+
+    // Scan cut short (same page): the next word may be the token.
+    if (end64 != (Token *)page && (end64->nonce & mask) + nonce == 0)
+    {
+        if (nonce_size == 61 && end64->boundary != 0)
+            end -= sizeof(Token) - end64->boundary;
+        return end;
+    }
+
+    // The token-free pages that follow:
+    while (end >= page && end - page < CLEAN_BOUND_MAX &&
+            token_map_covers((const void *)end,
+                (const void *)(end + PAGE_SIZE)) &&
+            !token_map_test((const void *)end))
+        end += PAGE_SIZE;
+    return end;
+}
+
+/*
+ * Attach to the comparison token buffer, if afl-fuzz provided one.
+ */
+static void dict_init(void)
+{
+    const char *str = getenv(DICT_ENV_VAR);
+    if (str == NULL)
+        return;
+    void *ptr = shmat((int)get_config(DICT_ENV_VAR, 0), NULL, 0);
+    if (ptr == (void *)-1)
+        error("failed to attach comparison token buffer %s: %s", str,
+            strerror(errno));
+    // The image holds the constants that inputs get compared against:
+    find_image();
+    if (image_hi == 0)
+        return;
+    dict = (Dict *)ptr;
+}
+
+/*
+ * Test if `ptr' points to a constant.
+ */
+static bool dict_constant(const void *ptr)
+{
+    pthread_mutex_lock(&dict_mutex);
+    size_t i = dict_range_find((uintptr_t)ptr);
+    bool found = (i < dict_range_count &&
+        (uintptr_t)ptr >= dict_ranges[i].lo);
+    pthread_mutex_unlock(&dict_mutex);
+    return found;
+}
+
+/*
+ * Record `ptr' as a comparison token if it points to a constant.
+ */
+static void dict_record(const void *ptr, size_t len)
+{
+    if (!dict_constant(ptr))
+        return;
+    if (len < DICT_LEN_MIN || len > DICT_LEN_MAX)
+        return;
+    if (dict->count >= DICT_MAX)
+        return;
+
+    // Only send each distinct token once (FNV-1a):
+    const uint8_t *ptr8 = (const uint8_t *)ptr;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ ptr8[i]) * 16777619u;
+    h ^= (uint32_t)len;
+    h %= DICT_SEEN;
+    uint8_t bit = 1 << (h % 8);
+    if (dict->seen[h / 8] & bit)
+        return;
+    __atomic_fetch_or(&dict->seen[h / 8], bit, __ATOMIC_RELAXED);
+
+    uint32_t i = __atomic_fetch_add(&dict->count, 1, __ATOMIC_RELAXED);
+    if (i >= DICT_MAX)
+        return;
+    for (size_t j = 0; j < len; j++)
+        dict->tokens[i].data[j] = ptr8[j];
+    dict->tokens[i].len = (uint8_t)len;
+}
+
+/*
+ * Record the constant operand (if any) of a string comparison.
+ */
+static void dict_record_str(const char *s1, const char *s2, size_t n)
+{
+    const char *s = NULL;
+    if (dict_constant(s1))
+        s = s1;
+    else if (dict_constant(s2))
+        s = s2;
+    else
+        return;
+    size_t len = 0;
+    while (len < n && len <= DICT_LEN_MAX && s[len] != '\0')
+        len++;
+    dict_record(s, len);
+}
+
+/*
+ * Test if `pc' is in the runtime's code inside the executable's image.  With
+ * librezzan.a, install.sh moves the runtime's code and data into sections of
+ * their own.
+ */
+#ifdef REZZAN_STATIC
+#define REZZAN_SECTION(name)                                            \
+    extern const uint8_t __start_##name[]                               \
+        __attribute__((__weak__, __visibility__("hidden")));            \
+    extern const uint8_t __stop_##name[]                                \
+        __attribute__((__weak__, __visibility__("hidden")))
+REZZAN_SECTION(rezzan_text);
+REZZAN_SECTION(rezzan_data);
+REZZAN_SECTION(rezzan_bss);
+#endif
+static inline bool runtime_contains(uintptr_t pc)
+{
+#ifdef REZZAN_STATIC
+    return (pc >= (uintptr_t)__start_rezzan_text &&
+        pc < (uintptr_t)__stop_rezzan_text);
+#else
+    (void)pc;
+    return false;       // librezzan.so is outside the image
+#endif
+}
+
+/*
+ * Test if `addr' looks like a return address into the executable, i.e., is
+ * preceded by a call instruction.
+ */
+static bool is_return_address(uintptr_t addr)
+{
+    if (addr < image_lo + 6 || addr >= image_hi || runtime_contains(addr))
+        return false;
+    const uint8_t *p = (const uint8_t *)addr;
+    return (p[-5] == 0xe8 ||                                // call rel32
+        (p[-6] == 0xff && p[-5] == 0x15) ||                 // call *rel32(%rip)
+        (p[-2] == 0xff && (p[-1] & 0xf8) == 0xd0) ||        // call *%reg
+        (p[-3] == 0x41 && p[-2] == 0xff && (p[-1] & 0xf8) == 0xd0) ||
+        (p[-3] == 0xff && (p[-2] & 0xf8) == 0x50));         // call *d8(%reg)
+}
+
+/*
+ * Record the fault for afl-triage.  The fault class comes from the error()
+ * message or the signal, while the site and stack hash come from a scan of
+ * the stack for return addresses; this needs neither frame pointers nor
+ * unwind tables (the check code has none).  Returning re-raises the fault
+ * with the default action (SA_RESETHAND).
+ */
+static void triage_handler(int sig, siginfo_t *info, void *ctx)
+{
+    (void)info;
+    ucontext_t *uc = (ucontext_t *)ctx;
+    uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+
+    // Fault class:
+    char *what = triage->what;
+    size_t len = 0, max = sizeof(triage->what) - 1;
+    const char *str = NULL;
+    Dl_info dli;
+    if (error_msg != NULL)
+    {
+        for (; len < max && error_msg[len] != '\0' &&
+                strchr("%;:", error_msg[len]) == NULL; len++)
+            what[len] = error_msg[len];
+        what[len] = '\0';
+        char *with = strstr(what, " with ");
+        if (with != NULL)
+            len = with - what;
+        while (len > 0 && what[len-1] == ' ')
+            len--;
+    }
+    else
+    {
+        switch (sig)
+        {
+            case SIGILL:
+                str = "invalid memory access"; break;
+            case SIGSEGV: case SIGBUS:
+                str = "segmentation fault"; break;
+            case SIGFPE:
+                str = "floating point exception"; break;
+            default:
+                str = "abort"; break;
+        }
+        for (; len < max && *str != '\0'; len++)
+            what[len] = *str++;
+        if (sig == SIGILL && dladdr((void *)pc, &dli) != 0 &&
+                (dli.dli_fbase == runtime_base || runtime_contains(pc)) &&
+                dli.dli_sname != NULL)
+        {
+            for (str = " in "; len < max && *str != '\0'; len++)
+                what[len] = *str++;
+            for (str = dli.dli_sname; len < max && *str != '\0'; len++)
+                what[len] = *str++;
+        }
+    }
+    what[len] = '\0';
+
+    // Call stack.  Faults inside a frameless helper called from the
+    // executable (e.g., __rezzan_check) are attributed to the caller:
+    uintptr_t frames[TRIAGE_FRAMES];
+    size_t n = 0;
+    if (pc >= image_lo && pc < image_hi && !runtime_contains(pc))
+    {
+        uintptr_t ret = *(uintptr_t *)sp;
+        bool leaf = false;
+        if (is_return_address(ret) && ((uint8_t *)ret)[-5] == 0xe8)
+        {
+            uintptr_t target = ret + *(int32_t *)(ret - 4);
+            leaf = (pc >= target && pc < target + 256);
+        }
+        if (!leaf)
+            frames[n++] = pc;
+    }
+    uintptr_t end = sp + TRIAGE_SCAN_MAX * sizeof(uintptr_t);
+    if (sp < stack_hi && end > stack_hi)
+        end = stack_hi;
+    else if (sp >= stack_hi || stack_hi - sp > (1ull << 23))
+        end = sp + 64 * sizeof(uintptr_t);      // Some other thread
+    for (uintptr_t *p = (uintptr_t *)sp; n < TRIAGE_FRAMES &&
+            (uintptr_t)p < end; p++)
+    {
+        if (is_return_address(*p))
+            frames[n++] = *p;
+    }
+
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (frames[i] - image_lo)) * 1099511628211ull;
+
+    triage->signal     = (uint32_t)sig;
+    triage->site       = (n > 0? frames[0] - image_lo: 0);
+    triage->stack_hash = h;
+    __atomic_store_n(&triage->valid, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Attach to afl-triage's fault record, if any, and install the handler.
+ */
+static void triage_init(void)
+{
+    const char *str = getenv(TRIAGE_ENV_VAR);
+    if (str == NULL)
+        return;
+    void *ptr = shmat((int)get_config(TRIAGE_ENV_VAR, 0), NULL, 0);
+    if (ptr == (void *)-1)
+        error("failed to attach fault record %s: %s", str, strerror(errno));
+    triage = (Triage *)ptr;
+    find_image();
+#ifndef REZZAN_STATIC
+    Dl_info dli;
+    if (dladdr((void *)triage_handler, &dli) != 0)
+        runtime_base = dli.dli_fbase;
+#endif
+
+    // Stack overflows need an alternate signal stack:
+    stack_t ss;
+    ss.ss_size  = 16 * PAGE_SIZE;
+    ss.ss_flags = 0;
+    ss.ss_sp    = mmap(NULL, ss.ss_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ss.ss_sp != MAP_FAILED)
+        (void)sigaltstack(&ss, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = triage_handler;
+    sa.sa_flags     = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    const int sigs[] = {SIGILL, SIGSEGV, SIGBUS, SIGFPE, SIGABRT};
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+        (void)sigaction(sigs[i], &sa, NULL);
+}
+
+/*
+ * Allocation tracing (REZZAN_TRACE=file).  Every malloc/free/realloc/calloc
+ * is logged as a fixed-size record, buffered, and appended to the file at
+ * exit.  A "%p" in the file name is replaced by the pid, so that each
+ * forkserver child writes its own trace.  Each exec's records follow a
+ * TraceHeader.  The layout must match rezzan_replay.c.
+ */
+#define TRACE_MAGIC     "RZTRACE1"
+enum
+{
+    TRACE_MALLOC = 1,
+    TRACE_FREE,
+    TRACE_REALLOC,
+    TRACE_CALLOC,
+};
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+typedef struct
+{
+    uint8_t  op;
+    uint8_t  thread;        // Small per-thread number
+    uint16_t reserved;
+    uint32_t time;          // Microseconds since the exec started
+    uint64_t size;
+    uint64_t ptr;           // The object (its address is its id)
+    uint64_t old;           // realloc(): the old object
+} TraceRecord;
+#define TRACE_BUF_SIZE          4096
+static const char     *trace_path = NULL;
+static int             trace_fd   = -1;
+static TraceRecord     trace_buf[TRACE_BUF_SIZE];
+static size_t          trace_len  = 0;
+static struct timespec trace_start;
+static uint8_t         trace_threads = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint8_t trace_thread = 0;
+static __thread int     trace_nest   = 0;   // Inside realloc()/calloc()
+
+static void trace_flush(void)
+{
+    if (trace_len == 0)
+        return;
+    if (trace_fd < 0)
+    {
+        char path[4096];
+        size_t j = 0;
+        for (size_t i = 0; trace_path[i] != '\0' && j < sizeof(path) - 32;
+                i++)
+        {
+            if (trace_path[i] == '%' && trace_path[i+1] == 'p')
+            {
+                j += snprintf(path + j, 32, "%d", (int)getpid());
+                i++;
+            }
+            else
+                path[j++] = trace_path[i];
+        }
+        path[j] = '\0';
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+        if (trace_fd < 0)
+            error("failed to open trace file \"%s\": %s", path,
+                strerror(errno));
+        TraceHeader hdr = {TRACE_MAGIC, 1, sizeof(TraceRecord)};
+        if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            error("failed to write trace file: %s", strerror(errno));
+    }
+    size_t size = trace_len * sizeof(TraceRecord);
+    if (write(trace_fd, trace_buf, size) != (ssize_t)size)
+        error("failed to write trace file: %s", strerror(errno));
+    trace_len = 0;
+}
+
+static void trace_record(uint8_t op, size_t size, const void *ptr,
+    const void *old)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_thread == 0)
+        trace_thread = (trace_threads == UINT8_MAX? UINT8_MAX:
+            ++trace_threads);
+    TraceRecord *record = trace_buf + trace_len++;
+    record->op       = op;
+    record->thread   = trace_thread;
+    record->reserved = 0;
+    record->time     = (uint32_t)((now.tv_sec - trace_start.tv_sec) *
+        1000000 + (now.tv_nsec - trace_start.tv_nsec) / 1000);
+    record->size     = size;
+    record->ptr      = (uint64_t)ptr;
+    record->old      = (uint64_t)old;
+    if (trace_len == TRACE_BUF_SIZE)
+        trace_flush();
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/*
+ * A forked child is a new exec, with its own trace.
+ */
+static void trace_atfork_child(void)
+{
+    pthread_mutex_init(&trace_mutex, NULL);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    trace_fd  = -1;
+    trace_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+}
+
+static void trace_init(void)
+{
+    trace_path = getenv("REZZAN_TRACE");
+    if (trace_path == NULL || trace_path[0] == '\0')
+    {
+        trace_path = NULL;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+}
+
+/*
+ * Randomized partial checking (REZZAN_GROUPS).  The pass assigns each check
+ * site to one of __rezzan_groups groups, and only checks if the site's group
+ * is enabled in the mask next to the nonce.  Each exec (i.e., forkserver
+ * child) enables a different random subset of REZZAN_GROUPS_ENABLED groups,
+ * so that every site is still checked over a campaign.
+ */
+#define GROUPS_ADDR     ((uint64_t *)0x10008)
+#define GROUPS_MAX      64
+
+extern const unsigned __rezzan_groups __attribute__((__weak__));
+static size_t groups         = 0;
+static size_t groups_enabled = 0;
+
+static void groups_select(void)
+{
+    uint64_t mask = UINT64_MAX;
+    if (groups_enabled < groups)
+    {
+        uint8_t order[GROUPS_MAX], seed[GROUPS_MAX];
+        if (getrandom(seed, sizeof(seed), 0) < 0)
+            error("failed to select check groups: %s", strerror(errno));
+        for (size_t i = 0; i < groups; i++)
+            order[i] = (uint8_t)i;
+        mask = 0;
+        for (size_t i = 0; i < groups_enabled; i++)
+        {
+            size_t j = i + seed[i] % (groups - i);
+            uint8_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+            mask |= 1ull << order[i];
+        }
+    }
+    (void)mprotect(NONCE_ADDR, PAGE_SIZE, PROT_READ | PROT_WRITE);
+    *GROUPS_ADDR = mask;
+    (void)mprotect(NONCE_ADDR, PAGE_SIZE, PROT_READ);
+}
+
+static void groups_init(void)
+{
+    groups = (&__rezzan_groups != NULL? __rezzan_groups: 0);
+    groups = (groups > GROUPS_MAX? GROUPS_MAX: groups);
+    groups_enabled = get_config("REZZAN_GROUPS_ENABLED", groups);
+    groups_select();
+    if (groups_enabled < groups)
+        pthread_atfork(NULL, NULL, groups_select);
+}
+
 /*
  * ReZZan initialization.
  */
@@ -376,16 +1502,40 @@ void REZZAN_CONSTRUCTOR rezzan_init(void)
     const size_t QUARANTINE_SIZE = (1ull << 28);    // 256Mb == ASAN default
     quarantine_size = get_config("REZZAN_QUARANTINE_SIZE", QUARANTINE_SIZE);
     quarantine_size /= sizeof(Unit);
-    pool_size = get_config("REZZAN_POOL_SIZE", POOL_SIZE);
-    if (pool_size < POOL_MMAP_SIZE * sizeof(Unit))
+    pool_size = get_config("REZZAN_POOL_SIZE", 0);
+    if (pool_size != 0 && pool_size < POOL_MMAP_SIZE * sizeof(Unit))
         error("invalud pool size (%zu); must be greater than %zu", pool_size,
             POOL_MMAP_SIZE);
     if (pool_size % PAGE_SIZE != 0)
         error("invalid pool size (%zu); must be divisible by the page size "
             "(%zu)", pool_size, PAGE_SIZE);
+    remap_size = get_config("REZZAN_REMAP_SIZE", 16 * PAGE_SIZE);
     option_debug    = (bool)get_config("REZZAN_DEBUG", 0);
     option_checks   = (bool)get_config("REZZAN_CHECKS", 0);
     option_populate = (bool)get_config("REZZAN_POPULATE", 0);
+    option_prezero  = (bool)get_config("REZZAN_PREZERO", 0);
+    option_no_reuse = (bool)get_config("REZZAN_NO_REUSE", 0);
+    option_fast_exit = (bool)get_config("REZZAN_FAST_EXIT", 0);
+    option_leaks     = (bool)get_config("REZZAN_DETECT_LEAKS", 0);
+    leak_budget      = get_config("REZZAN_LEAK_BUDGET", 100);
+    option_lowfat    = (bool)get_config("REZZAN_LOWFAT", 0);
+    option_regions   = (bool)get_config("REZZAN_REGIONS", 1);
+    option_scopes    = get_scopes("REZZAN_SCOPES",
+        (&__rezzan_scopes != NULL? __rezzan_scopes: SCOPE_ALL));
+    option_heap      = ((option_scopes & SCOPE_HEAP) != 0);
+    if (!option_heap)
+        option_leaks = false;   // glibc allocation
+    if (option_leaks)
+    {
+        // Only the pool is walked, and ready chunks are not walkable:
+        option_prezero = false;
+        option_lowfat  = false;
+    }
+    const size_t NO_REUSE_LIMIT = (1ull << 30);
+    no_reuse_limit = get_config("REZZAN_NO_REUSE_LIMIT", NO_REUSE_LIMIT);
+    if (pool_size != 0 && no_reuse_limit > pool_size / 2)
+        no_reuse_limit = pool_size / 2;
+    no_reuse_limit /= sizeof(Unit);
 
     // Init the random NONCE:
     void *ptr = mmap(NONCE_ADDR, PAGE_SIZE, PROT_READ | PROT_WRITE,
@@ -399,20 +1549,22 @@ void REZZAN_CONSTRUCTOR rezzan_init(void)
     if (nonce_size == 61)
         token->boundary = 0;
     (void)mprotect(ptr, PAGE_SIZE, PROT_READ);
+    groups_init();
 
     // Initialize malloc() pool:
-    int flags  = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+    int flags  = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
         (option_populate? MAP_POPULATE: 0);
-    void *base   = (void *)0xaaa00000000;
+    void *base = POOL_BASE;
     ptr = mmap(base, POOL_MMAP_SIZE * sizeof(Unit), PROT_READ | PROT_WRITE,
         flags, -1, 0);
-    if (ptr == MAP_FAILED)
-        error("failed to allocate memory pool of size %zu: %s",
-            pool_size, strerror(errno));
+    if (ptr != base)
+        error("failed to allocate memory pool at %p: %s", base,
+            (ptr == MAP_FAILED? strerror(errno): "address in use"));
     pool       = (Unit *)ptr;
     pool_size /= sizeof(Unit);
     pool_ptr   = 0;
     pool_mmap  = POOL_MMAP_SIZE;
+    token_map_grow(pool, pool + pool_mmap);
 
     // Initialize the quarantine pool:
     quarantine_pool_size = 2 * quarantine_size;
@@ -421,6 +1573,10 @@ void REZZAN_CONSTRUCTOR rezzan_init(void)
         QUARANTINE_POOL_SIZE_MIN: quarantine_pool_size);
 
     base = (void *)0xaa900000000;
+    if (quarantine_pool_size * sizeof(FreeNode) >
+            (uintptr_t)POOL_BASE - (uintptr_t)base)
+        error("invalid quarantine size (%zu); free list nodes do not fit "
+            "below the pool", quarantine_size * sizeof(Unit));
     ptr = mmap(base, QUARANTINE_MMAP_SIZE * sizeof(FreeNode),
         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
         -1, 0);
@@ -429,21 +1585,56 @@ void REZZAN_CONSTRUCTOR rezzan_init(void)
             quarantine_pool_size, strerror(errno));
     quarantine_pool = (FreeNode *)ptr;
     quarantine_mmap = QUARANTINE_MMAP_SIZE;
+    ready_limit = quarantine_size / 8;
+    ready_limit = (ready_limit < READY_LIMIT_MIN? READY_LIMIT_MIN:
+        ready_limit);
 
     // Poison the first unit so underflows will be detected:
     poison(&pool->t[0], 0);
     poison(&pool->t[1], 0);
     pool_ptr++;
 
+    // Attach to afl-fuzz's comparison token buffer (needs the nonce) and
+    // afl-triage's fault record:
+    dict_init();
+    triage_init();
+    trace_init();
+    region_init();
+
     option_inited = true;
     pthread_mutex_unlock(&malloc_mutex);
 }
 
+#ifdef REZZAN_STATIC
+/*
+ * Linked into the executable (librezzan.a), where rezzan_init() would run
+ * after the instrumented modules' constructors, which already need the
+ * nonce.  Run it first, as a pre-initializer, before libc has set environ.
+ */
+extern char **environ;
+static void rezzan_preinit(int argc, char **argv, char **envp)
+{
+    (void)argc;
+    (void)argv;
+    if (environ == NULL)
+        environ = envp;
+    rezzan_init();
+}
+__attribute__((__section__(".preinit_array"), __used__))
+static void (*rezzan_preinit_ptr)(int, char **, char **) = rezzan_preinit;
+#endif
+
 /*
  * ReZZan finalization.
  */
 void REZZAN_DESTRUCTOR rezzan_fini(void)
 {
+    if (trace_path != NULL)
+    {
+        pthread_mutex_lock(&trace_mutex);
+        trace_flush();
+        pthread_mutex_unlock(&trace_mutex);
+    }
     if (!option_stats)
         return;
 
@@ -455,6 +1646,16 @@ void REZZAN_DESTRUCTOR rezzan_fini(void)
     printf("pagefaults      = %zu faults\n", usage.ru_minflt + usage.ru_majflt);
     printf("allocated       = %zu bytes\n", pool_ptr * sizeof(Unit));
     printf("quarantined     = %zu bytes\n", quarantine_usage * sizeof(Unit));
+    printf("no-reuse        = %s\n", (option_no_reuse? "yes": "no"));
+    if (option_lowfat)
+    {
+        size_t lowfat = 0;
+        for (size_t i = 0; i < LOWFAT_CLASSES; i++)
+            lowfat += lowfat_ptr[i];
+        printf("low-fat         = %zu bytes\n", lowfat);
+        printf("low-fat quarantined = %zu bytes\n",
+            lowfat_usage * sizeof(Unit));
+    }
 }
 
 /*
@@ -529,9 +1730,135 @@ static void *quarantine_malloc(size_t size128)
             quarantine[j].front = node;
         }
         else
-            quarantine[j].front = quarantine[j].back = node;
+            quarantine[j].front = quarantine[j].back = node;
+        return ptr;
+    }
+}
+
+/*
+ * Allocate from the ready lists.  Ready chunks are zeroed except for their
+ * first and last tokens, which keep double-free detection working.
+ */
+static void *ready_malloc(size_t size128)
+{
+    size_t i = quarantine_index(size128);
+    FreeNode *node = NULL, *prev = NULL;
+    const size_t LIMIT = 8;
+    for (; i < sizeof(ready) / sizeof(ready[0]) && node == NULL; i++)
+    {
+        prev = NULL;
+        node = ready[i].front;
+        for (size_t j = 0; node != NULL && j < LIMIT; j++)
+        {
+            if (node->size128 >= size128)
+                break;
+            prev = node;
+            node = node->next;
+        }
+        node = (node != NULL && node->size128 < size128? NULL: node);
+    }
+    if (node == NULL)
+        return NULL;
+    i--;
+    if (prev != NULL)
+        prev->next = node->next;
+    else
+        ready[i].front = node->next;
+    if (ready[i].back == node)
+        ready[i].back = prev;
+
+    ready_usage -= size128;
+    pthread_cond_signal(&worker_cond);
+    if (node->size128 == size128)
+    {
+        Unit *ptr128 = pool + node->ptr128;
+        zero(&ptr128->t[0]);
+        node->next = quarantine_free;
+        quarantine_free = node;
+        return (void *)ptr128;
+    }
+
+    // Inexact match, the rest stays ready:
+    size_t diff128 = node->size128 - size128;
+    Unit *ptr128 = pool + node->ptr128 + diff128;
+    poison(&ptr128->t[0] - 1, 0);
+    size_t j = quarantine_index(diff128);
+    node->size128 = diff128;
+    node->next    = ready[j].front;
+    ready[j].front = node;
+    if (ready[j].back == NULL)
+        ready[j].back = node;
+    return (void *)ptr128;
+}
+
+/*
+ * Work out the low-fat size class from the size, or LOWFAT_CLASSES if the
+ * object is too big.
+ */
+static size_t lowfat_class(size_t size128)
+{
+    size_t i = (size128 <= 1? 0: 64 - __builtin_clzll(size128 - 1));
+    return (i < LOWFAT_CLASSES? i: LOWFAT_CLASSES);
+}
+
+/*
+ * Allocate a slot from the low-fat region `i'.  Slots are recycled, same
+ * class only, once the quarantine is full.
+ */
+static void *lowfat_malloc(size_t i, bool *recycled)
+{
+    size_t size128 = (size_t)1 << i;
+    FreeNode *node = lowfat_quarantine[i].front;
+    if (node != NULL && lowfat_usage > quarantine_size)
+    {
+        if (lowfat_quarantine[i].front != lowfat_quarantine[i].back)
+            lowfat_quarantine[i].front = node->next;
+        else
+            lowfat_quarantine[i].front = lowfat_quarantine[i].back = NULL;
+        lowfat_usage -= size128;
+        void *ptr = (void *)(pool + node->ptr128);
+        node->next = quarantine_free;
+        quarantine_free = node;
+        *recycled = true;
         return ptr;
     }
+
+    size_t size = size128 * sizeof(Unit);
+    uint8_t *region = (uint8_t *)(LOWFAT_BASE + (i << LOWFAT_REGION_SHIFT));
+    size_t need = lowfat_ptr[i] + size + (lowfat_mmap[i] == 0? size: 0);
+    if (need > (1ull << LOWFAT_REGION_SHIFT))
+        return NULL;            // Region is full, use the pool.
+    if (need > lowfat_mmap[i])
+    {
+        size_t grow = POOL_MMAP_SIZE * sizeof(Unit);
+        grow = (need - lowfat_mmap[i] > grow? need - lowfat_mmap[i]: grow);
+        if (lowfat_mmap[i] + grow > (1ull << LOWFAT_REGION_SHIFT))
+            grow = (1ull << LOWFAT_REGION_SHIFT) - lowfat_mmap[i];
+        uint8_t *start = region + lowfat_mmap[i];
+        int flags  = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
+            (option_populate? MAP_POPULATE: 0);
+        void *ptr = mmap(start, grow, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr != (void *)start)
+        {
+            if (ptr != MAP_FAILED)
+                (void)munmap(ptr, grow);
+            error("failed to allocate %zu bytes for low-fat region: %s",
+                grow, (ptr == MAP_FAILED? strerror(errno):
+                    "address in use"));
+        }
+        token_map_grow(start, start + grow);
+        if (lowfat_mmap[i] == 0)
+        {
+            // Slot 0 is never used, its last token guards underflows of
+            // slot 1:
+            poison((Token *)(start + size) - 1, 0);
+            lowfat_ptr[i] = size;
+        }
+        lowfat_mmap[i] += grow;
+    }
+    void *ptr = (void *)(region + lowfat_ptr[i]);
+    lowfat_ptr[i] += size;
+    return ptr;
 }
 
 /*
@@ -541,7 +1868,7 @@ static void *pool_malloc(size_t size128)
 {
     void *ptr = (void *)(pool + pool_ptr);
     size_t new_pool_ptr = pool_ptr + size128;
-    if (new_pool_ptr > pool_size)
+    if (pool_size != 0 && new_pool_ptr > pool_size)
     {
         // Out-of-space:
         errno = ENOMEM;
@@ -549,6 +1876,8 @@ static void *pool_malloc(size_t size128)
     }
     if (new_pool_ptr > pool_mmap)
     {
+        // Chain the next segment.  MAP_FIXED_NOREPLACE makes sure that we
+        // never clobber a mapping that happens to follow the pool:
         size_t old_pool_mmap = pool_mmap;
         pool_mmap = new_pool_ptr + POOL_MMAP_SIZE;
         size_t page_units = PAGE_SIZE / sizeof(Unit);
@@ -557,18 +1886,24 @@ static void *pool_malloc(size_t size128)
             pool_mmap += page_units;
             pool_mmap -= pool_mmap % page_units;
         }
-        if (pool_mmap > pool_size)
+        if (pool_size != 0 && pool_mmap > pool_size)
             pool_mmap = pool_size;
 
         uint8_t *start = (uint8_t *)(pool + old_pool_mmap);
         uint8_t *end   = (uint8_t *)(pool + pool_mmap);
-        int flags  = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+        int flags  = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE |
             (option_populate? MAP_POPULATE: 0);
         void *ptr = mmap(start, end - start, PROT_READ | PROT_WRITE, flags,
             -1, 0);
         if (ptr != (void *)start)
+        {
+            if (ptr != MAP_FAILED)
+                (void)munmap(ptr, end - start);
             error("failed to allocate %zu bytes for malloc pool: %s",
-                end - start, strerror(errno));
+                end - start, (ptr == MAP_FAILED? strerror(errno):
+                    "address in use"));
+        }
+        token_map_grow(start, end);
         DEBUG("GROW %p..%p\n", start, end);
     }
     pool_ptr += size128;
@@ -581,7 +1916,7 @@ static void *pool_malloc(size_t size128)
 void *rezzan_malloc(size_t size)
 {
     // Check for initialization:
-    if (!option_enabled)
+    if (!option_heap)
         return __libc_malloc(size);
 
     // Calculate the necessary sizes:
@@ -595,15 +1930,32 @@ void *rezzan_malloc(size_t size)
         size128 += sizeof(Unit);
     }
     size128 /= sizeof(Unit);
+    size_t lowfat = (option_lowfat? lowfat_class(size128): LOWFAT_CLASSES);
 
-    // Allocate from the pool or the quarantine:
+    // Allocate from the low-fat heap, the ready lists, the pool or the
+    // quarantine:
     void *ptr = NULL;
     pthread_mutex_lock(&malloc_mutex);
 
-    if (quarantine_usage > quarantine_size)
-        ptr = quarantine_malloc(size128);
-    bool q = (ptr != NULL);
-    if (!q)
+    // (In no-reuse mode, the ready lists and quarantine stay empty.)
+    if (option_no_reuse && pool_ptr + size128 > no_reuse_limit)
+    {
+        // The pool is running low, so start recycling memory.  Objects
+        // freed until now are never reused.
+        option_no_reuse = false;
+        DEBUG("no-reuse fallback [allocated=%zu]", pool_ptr * sizeof(Unit));
+    }
+    bool r = false, q = false;
+    if (lowfat < LOWFAT_CLASSES)
+    {
+        ptr = lowfat_malloc(lowfat, &q);
+        size128 = (ptr != NULL? (size_t)1 << lowfat: size128);
+    }
+    if (ptr == NULL && ready_usage != 0)
+        r = ((ptr = ready_malloc(size128)) != NULL);
+    if (ptr == NULL && quarantine_usage > quarantine_size)
+        q = ((ptr = quarantine_malloc(size128)) != NULL);
+    if (ptr == NULL)
         ptr = pool_malloc(size128);
     if (ptr == NULL)
         error("failed to allocate memory: %s", strerror(ENOMEM));
@@ -615,7 +1967,10 @@ void *rezzan_malloc(size_t size)
 
     pthread_mutex_unlock(&malloc_mutex);
 
-    // If allocated from the quarantine, zero the memory:
+    // If allocated from the quarantine, zero the memory.  Large chunks are
+    // zeroed by dropping their pages; this cannot be done when the chunk
+    // enters the quarantine, since the tokens are what detects
+    // use-after-free.
     if (q)
     {
         Token *start64 = (Token *)ptr;
@@ -625,9 +1980,7 @@ void *rezzan_malloc(size_t size)
             size64 -= size64 % sizeof(Token);
             size64 += sizeof(Token);
         }
-        Token *end64 = start64 + size64 / sizeof(Token);
-        for (; start64 < end64; start64++)
-            zero(start64);
+        zero_range(start64, start64 + size64 / sizeof(Token));
     }
 
     // Poison the rest of the redzone:
@@ -635,9 +1988,12 @@ void *rezzan_malloc(size_t size)
     for (end64--; (uint8_t *)end64 >= end8; end64--)
         poison(end64, size);
 
+    if (trace_path != NULL && trace_nest == 0)
+        trace_record(TRACE_MALLOC, size, ptr, NULL);
+
     // Debugging:
     DEBUG("malloc(%zu) = %p [size128=%zu (%zu), alloc=%c]", size, ptr,
-        size128, size128 * sizeof(Unit), (q? 'Q': 'P'));
+        size128, size128 * sizeof(Unit), (q? 'Q': r? 'R': 'P'));
     if (option_checks)
     {
         size_t i = 0;
@@ -654,7 +2010,7 @@ void *rezzan_malloc(size_t size)
                 "[ptr=%p, size=%zu, alloc=%c]",
                 end64, end8, sizeof(Token), ptr, size, (q? 'Q': 'P'));
         Token *ptr64 = (Token *)ptr;
-        if (!is_poisoned(ptr64-1))
+        if (!lowfat_contains(ptr) && !is_poisoned(ptr64-1))
             error("invalid object base detected "
                 "[ptr=%p, size=%zu, alloc=%c]", ptr, size, (q? 'Q': 'P'));
         for (i = 0; i * sizeof(Token) < size; i++)
@@ -685,8 +2041,8 @@ static void quarantine_insert(Unit *ptr128, size_t size128)
     FreeNode *node = quarantine_node_alloc();
     if (node == NULL)
         return;         // Memory leaks...
-    node->size128 = (uint32_t)size128;
-    node->ptr128  = (uint32_t)(ptr128 - pool);
+    node->size128 = size128;
+    node->ptr128  = ptr128 - pool;
     node->next    = NULL;
     size_t i = quarantine_index(size128);
     if (quarantine[i].back == NULL)
@@ -697,6 +2053,156 @@ static void quarantine_insert(Unit *ptr128, size_t size128)
         quarantine[i].back       = node;
     }
     quarantine_usage += size128;
+    if (worker_active && quarantine_usage > quarantine_size)
+        pthread_cond_signal(&worker_cond);
+}
+
+/*
+ * Insert a low-fat slot into its class quarantine.
+ */
+static void lowfat_insert(Unit *ptr128)
+{
+    size_t i = ((uintptr_t)ptr128 - LOWFAT_BASE) >> LOWFAT_REGION_SHIFT;
+    FreeNode *node = quarantine_node_alloc();
+    if (node == NULL)
+        return;         // Memory leaks...
+    node->ptr128  = ptr128 - pool;
+    node->size128 = (size_t)1 << i;
+    node->next    = NULL;
+    if (lowfat_quarantine[i].back == NULL)
+        lowfat_quarantine[i].front = lowfat_quarantine[i].back = node;
+    else
+    {
+        lowfat_quarantine[i].back->next = node;
+        lowfat_quarantine[i].back       = node;
+    }
+    lowfat_usage += node->size128;
+}
+
+/*
+ * Take the oldest chunk of some size class out of the quarantine.  The
+ * classes are visited round-robin.
+ */
+static FreeNode *quarantine_pop(void)
+{
+    static size_t next = 0;
+    size_t max = sizeof(quarantine) / sizeof(quarantine[0]);
+    for (size_t k = 0; k < max; k++)
+    {
+        size_t i = (next + k) % max;
+        FreeNode *node = quarantine[i].front;
+        if (node == NULL)
+            continue;
+        if (quarantine[i].front != quarantine[i].back)
+            quarantine[i].front = node->next;
+        else
+            quarantine[i].front = quarantine[i].back = NULL;
+        quarantine_usage -= node->size128;
+        next = i + 1;
+        return node;
+    }
+    return NULL;
+}
+
+/*
+ * Pre-zeroing worker.  Chunks only leave the quarantine when it is over its
+ * size limit, as with quarantine_malloc(), and the ready lists are bounded.
+ */
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&malloc_mutex);
+    while (true)
+    {
+        FreeNode *node = NULL;
+        if (quarantine_usage > quarantine_size && ready_usage < ready_limit)
+            node = quarantine_pop();
+        if (node == NULL)
+        {
+            pthread_cond_wait(&worker_cond, &malloc_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&malloc_mutex);
+
+        // The first and last tokens stay, see ready_malloc():
+        Token *start64 = (Token *)(pool + node->ptr128);
+        zero_range(start64 + 1, start64 + 2 * node->size128 - 1);
+
+        pthread_mutex_lock(&malloc_mutex);
+        size_t i = quarantine_index(node->size128);
+        node->next = NULL;
+        if (ready[i].back == NULL)
+            ready[i].front = ready[i].back = node;
+        else
+        {
+            ready[i].back->next = node;
+            ready[i].back       = node;
+        }
+        ready_usage += node->size128;
+    }
+    return NULL;
+}
+
+/*
+ * The worker does not survive fork(), so the child starts its own when
+ * needed.  The lock is held across fork() so the child gets a consistent
+ * heap.
+ */
+static void worker_atfork_prepare(void)
+{
+    pthread_mutex_lock(&malloc_mutex);
+}
+static void worker_atfork_parent(void)
+{
+    pthread_mutex_unlock(&malloc_mutex);
+}
+static void worker_atfork_child(void)
+{
+    worker_active = false;
+    pthread_mutex_init(&malloc_mutex, NULL);
+    pthread_cond_init(&worker_cond, NULL);
+}
+
+/*
+ * Start the worker, lazily, once the quarantine starts recycling memory.  A
+ * worker competing with the program for a single CPU would only slow it
+ * down (e.g., afl-fuzz binds each instance to one core), so it then stays
+ * off.  Must not be called with the lock held (pthread_create() may
+ * malloc()).
+ */
+static void worker_start(void)
+{
+    static pid_t worker_pid = 0;
+    pid_t pid = getpid();
+    if (worker_pid == pid)
+        return;
+    worker_pid = pid;
+
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0 ||
+            CPU_COUNT(&cpus) < 2)
+        return;
+    static bool registered = false;
+    if (!registered)
+    {
+        // Handlers are inherited by the child, so register once only:
+        pthread_atfork(worker_atfork_prepare, worker_atfork_parent,
+            worker_atfork_child);
+        registered = true;
+    }
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 16 * PAGE_SIZE);
+    if (pthread_create(&thread, &attr, worker_main, NULL) == 0)
+    {
+        pthread_mutex_lock(&malloc_mutex);
+        worker_active = true;
+        pthread_mutex_unlock(&malloc_mutex);
+        DEBUG("worker started");
+    }
+    pthread_attr_destroy(&attr);
 }
 
 /*
@@ -706,7 +2212,7 @@ void rezzan_free(void *ptr)
 {
     if (ptr == NULL)
         return;
-    if (!option_enabled)
+    if (!option_heap)
     {
         __libc_free(ptr);
         return;
@@ -718,7 +2224,8 @@ void rezzan_free(void *ptr)
         error("bad free detected with pointer %p; pointer is not "
             "16-byte aligned", ptr);
     Unit *ptr128 = (Unit *)ptr;
-    if (ptr128 < pool || ptr128 >= pool + pool_size)
+    bool lowfat = lowfat_contains(ptr128);
+    if (!lowfat && !pool_contains(ptr128))
     {
         // Not allocated by us...
         __libc_free(ptr);
@@ -728,22 +2235,42 @@ void rezzan_free(void *ptr)
         error("bad or double-free detected with pointer %p; memory is "
             "already poisoned", ptr);
     Token *ptr64 = (Token *)ptr;
-    if (!is_poisoned(ptr64-1))
+    if (lowfat? lowfat_base(ptr) != ptr: !is_poisoned(ptr64-1))
         error("bad free detected with pointer %p; pointer does not "
             "point to the base of the object", ptr);
+    if (trace_path != NULL && trace_nest == 0)
+        trace_record(TRACE_FREE, 0, ptr, NULL);
+    if (exiting)
+    {
+        // Teardown: the first token is enough to catch a later double free.
+        poison(ptr64, 0);
+        return;
+    }
 
-    // Poison the free'ed memory, and work out the object size.
-    size_t i = 0;
-    for (; !is_poisoned(ptr64 + i); i++)
+    // Poison the free'ed memory, and work out the object size.  Low-fat
+    // slots are poisoned whole, since the arithmetic checks do not notice
+    // writes that clobber the token after the object.
+    size_t i = 0, n = (lowfat? lowfat_size64(ptr): SIZE_MAX);
+    for (; i < n && (lowfat || !is_poisoned(ptr64 + i)); i++)
         poison(ptr64 + i, 0);
-    size_t size64 = i + 1;
+    size_t size64 = (lowfat? n: i + 1);
     if (size64 % 2 == 1)
         size64++;
     size_t size128 = size64 / 2;
+    if (option_no_reuse)
+        return;                 // Poisoned forever, no bookkeeping.
 
     pthread_mutex_lock(&malloc_mutex);
-    quarantine_insert(ptr128, size128);
+    if (lowfat)
+        lowfat_insert(ptr128);
+    else
+        quarantine_insert(ptr128, size128);
+    bool start = (option_prezero && !worker_active &&
+        quarantine_usage > quarantine_size);
     pthread_mutex_unlock(&malloc_mutex);
+
+    if (start)
+        worker_start();
 }
 
 /*
@@ -751,16 +2278,23 @@ void rezzan_free(void *ptr)
  */
 void *rezzan_realloc(void *ptr, size_t size)
 {
-    if (!option_enabled)
+    if (!option_heap)
         return __libc_realloc(ptr, size);
 
     if (ptr == NULL)
         return malloc(size);
+    if (trace_path != NULL && trace_nest == 0)
+    {
+        trace_nest++;
+        void *new_ptr = rezzan_realloc(ptr, size);
+        trace_nest--;
+        trace_record(TRACE_REALLOC, size, new_ptr, ptr);
+        return new_ptr;
+    }
     if ((uintptr_t)ptr % sizeof(Unit) != 0)
         error("bad free with (ptr=%p) not aligned to a 16 byte boundary",
             ptr);
-    Unit *ptr128 = (Unit *)ptr;
-    if (ptr128 < pool || ptr128 >= pool + pool_size)
+    if (!heap_contains(ptr))
     {
         // Not allocated by us...
         return __libc_realloc(ptr, size);
@@ -768,7 +2302,8 @@ void *rezzan_realloc(void *ptr, size_t size)
 
     size_t old_size64 = 0;
     Token *ptr64 = (Token *)ptr;
-    while (!is_poisoned(ptr64++))
+    size_t max64 = (lowfat_contains(ptr)? lowfat_size64(ptr) - 1: SIZE_MAX);
+    while (old_size64 < max64 && !is_poisoned(ptr64++))
         old_size64++;
     size_t old_size = old_size64 * sizeof(Token);
     size_t new_size = size;
@@ -793,11 +2328,15 @@ void *rezzan_realloc(void *ptr, size_t size)
  */
 void *rezzan_calloc(size_t nmemb, size_t size)
 {
-    if (!option_enabled)
+    if (!option_heap)
         return __libc_calloc(nmemb, size);
 
     // ReZZan's malloc() already zero's memory.
+    trace_nest++;
     void *ptr = rezzan_malloc(nmemb * size);
+    trace_nest--;
+    if (trace_path != NULL && trace_nest == 0)
+        trace_record(TRACE_CALLOC, nmemb * size, ptr, NULL);
     if (ptr != NULL && option_checks)
     {
         uint8_t *ptr8 = (uint8_t *)ptr;
@@ -812,7 +2351,7 @@ void *rezzan_calloc(size_t nmemb, size_t size)
  * The glib runtime support.
  */
 
-void *memcpy(void * restrict dst, const void * restrict src, size_t n)
+void *rezzan_memcpy(void * restrict dst, const void * restrict src, size_t n)
 {
     check_poisoned(dst, n);
     check_poisoned(src, n);
@@ -989,6 +2528,85 @@ wchar_t* wcscpy(wchar_t *dest, const wchar_t *src)
   return __wmemcpy(dest, src, __wcslen(src) + 1);
 }
 
+static inline int to_lower(int c)
+{
+    return (c >= 'A' && c <= 'Z'? c + ('a' - 'A'): c);
+}
+
+int strcmp(const char *s1, const char *s2)
+{
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+    size_t i = 0;
+    for (; p1[i] == p2[i] && p1[i] != '\0'; i++)
+        ;
+    check_poisoned(s1, i + 1);
+    check_poisoned(s2, i + 1);
+    if (dict != NULL)
+        dict_record_str(s1, s2, SIZE_MAX);
+    return (int)p1[i] - (int)p2[i];
+}
+
+int strncmp(const char *s1, const char *s2, size_t n)
+{
+    if (n == 0)
+        return 0;
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+    size_t i = 0;
+    for (; i < n - 1 && p1[i] == p2[i] && p1[i] != '\0'; i++)
+        ;
+    check_poisoned(s1, i + 1);
+    check_poisoned(s2, i + 1);
+    if (dict != NULL)
+        dict_record_str(s1, s2, n);
+    return (int)p1[i] - (int)p2[i];
+}
+
+int strcasecmp(const char *s1, const char *s2)
+{
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+    size_t i = 0;
+    for (; to_lower(p1[i]) == to_lower(p2[i]) && p1[i] != '\0'; i++)
+        ;
+    check_poisoned(s1, i + 1);
+    check_poisoned(s2, i + 1);
+    if (dict != NULL)
+        dict_record_str(s1, s2, SIZE_MAX);
+    return to_lower(p1[i]) - to_lower(p2[i]);
+}
+
+int strncasecmp(const char *s1, const char *s2, size_t n)
+{
+    if (n == 0)
+        return 0;
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+    size_t i = 0;
+    for (; i < n - 1 && to_lower(p1[i]) == to_lower(p2[i]) && p1[i] != '\0';
+            i++)
+        ;
+    check_poisoned(s1, i + 1);
+    check_poisoned(s2, i + 1);
+    if (dict != NULL)
+        dict_record_str(s1, s2, n);
+    return to_lower(p1[i]) - to_lower(p2[i]);
+}
+
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+    check_poisoned(s1, n);
+    check_poisoned(s2, n);
+    if (dict != NULL)
+    {
+        dict_record(s1, n);
+        dict_record(s2, n);
+    }
+
+    const uint8_t *p1 = (const uint8_t *)s1, *p2 = (const uint8_t *)s2;
+    for (size_t i = 0; i < n; i++)
+        if (p1[i] != p2[i])
+            return (int)p1[i] - (int)p2[i];
+    return 0;
+}
+
 int snprintf(char *dst, size_t n, const char *format, ...)
 {
 
@@ -1041,6 +2659,424 @@ int printf(const char *format,...)
     return done;
 }
 
+/*
+ * Leak detection (REZZAN_DETECT_LEAKS).  Live objects are found by walking
+ * the pool: a live object starts with an unpoisoned word and runs until the
+ * first token, whereas freed memory is poisoned throughout.  Reachability is
+ * then worked out by conservatively scanning the roots (writable segments of
+ * the loaded images, the stack and registers) and the live objects.
+ */
+typedef struct
+{
+    uint64_t *start;        // Bit per unit: a live object starts here
+    uint64_t *mark;         // Bit per unit: the object is reachable
+    size_t   *work;         // Worklist of reachable objects to be scanned
+    size_t    nwork;
+    Unit     *lo, *hi;      // Part of the address space not to scan
+    struct timespec deadline;
+    size_t    ticks;
+    bool      timeout;
+} LeakState;
+
+static bool leak_timeout(LeakState *state)
+{
+    if (leak_budget == 0 || (++state->ticks % 1024) != 0)
+        return state->timeout;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > state->deadline.tv_sec ||
+            (now.tv_sec == state->deadline.tv_sec &&
+             now.tv_nsec > state->deadline.tv_nsec))
+        state->timeout = true;
+    return state->timeout;
+}
+
+static size_t leak_size64(size_t ptr128)
+{
+    Token *ptr64 = &pool[ptr128].t[0];
+    size_t i = 0;
+    while (!is_poisoned(ptr64 + i))
+        i++;
+    return i;
+}
+
+static void leak_scan(LeakState *state, const void *lo, const void *hi)
+{
+    const uintptr_t *ptr = (const uintptr_t *)(((uintptr_t)lo + 7) & ~7ull);
+    for (; (const void *)(ptr + 1) <= hi; ptr++)
+    {
+        const Unit *val = (const Unit *)*ptr;
+        if (!pool_contains(val))
+            continue;
+        Token *ptr64 = (Token *)((uintptr_t)val & ~7ull);
+        if (is_poisoned(ptr64))
+            continue;   // Redzone or freed memory
+        // An unpoisoned word belongs to the nearest object start below:
+        size_t ptr128 = val - pool;
+        size_t i = ptr128 / 64;
+        uint64_t bits = state->start[i] & (~0ull >> (63 - ptr128 % 64));
+        while (bits == 0 && i > 0)
+            bits = state->start[--i];
+        if (bits == 0)
+            continue;
+        ptr128 = 64 * i + (63 - __builtin_clzll(bits));
+        if (state->mark[ptr128 / 64] & (1ull << (ptr128 % 64)))
+            continue;
+        state->mark[ptr128 / 64] |= (1ull << (ptr128 % 64));
+        state->work[state->nwork++] = ptr128;
+    }
+}
+
+/*
+ * Scan [lo, hi) minus the runtime's own state (e.g., `pool' itself).
+ */
+static void leak_scan_roots(LeakState *state, const uint8_t *lo,
+    const uint8_t *hi)
+{
+#ifdef REZZAN_STATIC
+    const uint8_t *skip[2][2] =
+    {
+        {__start_rezzan_data, __stop_rezzan_data},
+        {__start_rezzan_bss,  __stop_rezzan_bss},
+    };
+    if (skip[0][0] > skip[1][0])
+    {
+        const uint8_t *tmp[2] = {skip[0][0], skip[0][1]};
+        skip[0][0] = skip[1][0]; skip[0][1] = skip[1][1];
+        skip[1][0] = tmp[0];     skip[1][1] = tmp[1];
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (skip[i][0] == NULL || skip[i][1] <= lo || skip[i][0] >= hi)
+            continue;
+        if (skip[i][0] > lo)
+            leak_scan(state, lo, skip[i][0]);
+        lo = (skip[i][1] > lo? skip[i][1]: lo);
+    }
+    if (lo < hi)
+        leak_scan(state, lo, hi);
+#else
+    if ((const uint8_t *)&pool >= lo && (const uint8_t *)&pool < hi)
+        return;
+    leak_scan(state, lo, hi);
+#endif
+}
+
+static int leak_scan_image(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    LeakState *state = (LeakState *)arg;
+    (void)size;
+    for (size_t i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) *phdr = info->dlpi_phdr + i;
+        if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_W) == 0)
+            continue;
+        const uint8_t *lo = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+        const uint8_t *hi = lo + phdr->p_memsz;
+        leak_scan_roots(state, lo, hi);
+    }
+    return 0;
+}
+
+/*
+ * Scan the stacks of the other threads, which are registered as regions
+ * (along with the globals, which are scanned again).  The lock keeps the
+ * threads from removing their regions, and thus from unmapping the stacks.
+ * The main stack's region spans the stack limit, of which only the top is
+ * mapped.
+ */
+static void leak_scan_stacks(LeakState *state, uintptr_t self_hi)
+{
+    pthread_mutex_lock(&region_mutex);
+    for (size_t i = 0; i < region_count; i++)
+    {
+        uintptr_t lo = regions[i].lo, hi = regions[i].hi;
+        if (hi == 0 || hi == self_hi)
+            continue;
+        if (hi == stack_hi)
+        {
+            uint8_t vec;
+            uintptr_t top = hi;
+            while (top - PAGE_SIZE >= lo &&
+                    mincore((void *)(top - PAGE_SIZE), PAGE_SIZE, &vec) == 0)
+                top -= PAGE_SIZE;
+            lo = top;
+        }
+        leak_scan(state, (const void *)lo, (const void *)hi);
+    }
+    pthread_mutex_unlock(&region_mutex);
+}
+
+static void __attribute__((__noinline__)) leak_check(void)
+{
+    __builtin_unwind_init();    // Spill the registers onto the stack
+
+    // The current thread's stack (which need not be the main one):
+    uintptr_t sp = (uintptr_t)__builtin_frame_address(0), sp_hi = 0;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        void *stack = NULL;
+        size_t size = 0;
+        (void)pthread_attr_getstack(&attr, &stack, &size);
+        pthread_attr_destroy(&attr);
+        if (sp >= (uintptr_t)stack && sp < (uintptr_t)stack + size)
+            sp_hi = (uintptr_t)stack + size;
+    }
+    // Other threads, counting the main thread if this is not it:
+    bool others = (thread_started ||
+        __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE) > 0);
+    if (sp_hi == 0)
+    {
+        DEBUG("leak check skipped; stack not found");
+        return;
+    }
+    if (others && (!(option_scopes & SCOPE_STACK) ||
+            __atomic_load_n(&region_full, __ATOMIC_ACQUIRE)))
+    {
+        DEBUG("leak check skipped; the stacks of the other threads are not "
+            "registered");
+        return;
+    }
+
+    pthread_mutex_lock(&malloc_mutex);
+
+    LeakState state = {0};
+    clock_gettime(CLOCK_MONOTONIC, &state.deadline);
+    state.deadline.tv_sec  += leak_budget / 1000;
+    state.deadline.tv_nsec += (leak_budget % 1000) * 1000000;
+    if (state.deadline.tv_nsec >= 1000000000)
+    {
+        state.deadline.tv_sec++;
+        state.deadline.tv_nsec -= 1000000000;
+    }
+
+    size_t nbits = (pool_ptr + 63) / 64;
+    size_t size  = 2 * nbits * sizeof(uint64_t);
+    uint8_t *ptr = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&malloc_mutex);
+        return;
+    }
+    state.start = (uint64_t *)ptr;
+    state.mark  = state.start + nbits;
+
+    // Find the live objects:
+    size_t nobjs = 0;
+    for (size_t ptr128 = 0; ptr128 < pool_ptr && !leak_timeout(&state); )
+    {
+        if (is_poisoned(&pool[ptr128].t[0]))
+        {
+            ptr128++;
+            continue;
+        }
+        state.start[ptr128 / 64] |= (1ull << (ptr128 % 64));
+        nobjs++;
+        ptr128 += (leak_size64(ptr128) + 2) / 2;
+    }
+    size_t work_size = (nobjs + 1) * sizeof(size_t);
+    state.work = (size_t *)mmap(NULL, work_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (state.work == MAP_FAILED)
+        state.timeout = true;
+
+    // Mark everything reachable from the roots:
+    if (!state.timeout)
+    {
+        find_image();
+        leak_scan(&state, (const void *)sp, (const void *)sp_hi);
+        if (others)
+            leak_scan_stacks(&state, sp_hi);
+        dl_iterate_phdr(leak_scan_image, &state);
+    }
+    while (state.nwork > 0 && !leak_timeout(&state))
+    {
+        size_t ptr128 = state.work[--state.nwork];
+        Token *ptr64 = &pool[ptr128].t[0];
+        leak_scan(&state, ptr64, ptr64 + leak_size64(ptr128));
+    }
+
+    // Anything left unmarked is leaked:
+    size_t nleaks = 0, leaked = 0;
+    void *example = NULL;
+    size_t example_size = 0;
+    for (size_t i = 0; i < nbits && !state.timeout; i++)
+    {
+        uint64_t bits = state.start[i] & ~state.mark[i];
+        for (; bits != 0; bits &= bits - 1)
+        {
+            size_t ptr128 = 64 * i + __builtin_ctzll(bits);
+            size_t size = leak_size64(ptr128) * sizeof(Token);
+            if (example == NULL)
+            {
+                example = (void *)(pool + ptr128);
+                example_size = size;
+            }
+            nleaks++;
+            leaked += size;
+        }
+    }
+    if (state.work != MAP_FAILED)
+        (void)munmap(state.work, work_size);
+    (void)munmap(ptr, size);
+    pthread_mutex_unlock(&malloc_mutex);
+
+    if (state.timeout)
+        DEBUG("leak check skipped; time budget of %zums exceeded",
+            leak_budget);
+    else if (nleaks > 0)
+        error("memory leak detected; %zu object(s) (%zu bytes) unreachable "
+            "at exit, e.g. %p (%zu bytes)", nleaks, leaked, example,
+            example_size);
+}
+
+/*
+ * Exit detection.  Teardown starts when main() returns or exit() is called;
+ * this is where leaks are checked for (REZZAN_DETECT_LEAKS), before static
+ * destructors and atexit() handlers run.  Frees during teardown cannot find
+ * new bugs in the program logic, so with REZZAN_FAST_EXIT they only check
+ * for bad/double frees.
+ */
+static inline bool exit_hooked(void)
+{
+    // Before rezzan_init() (not expected), the options are unknown:
+    return !option_inited ||
+        (option_enabled && (option_leaks || option_fast_exit));
+}
+
+static void exit_begin(void)
+{
+    static bool done = false;
+    if (done || !option_enabled)
+        return;
+    done = true;
+    if (option_leaks)
+        leak_check();
+    if (option_fast_exit)
+        exiting = true;
+}
+
+typedef int (*main_t)(int, char **, char **);
+typedef int (*libc_start_main_t)(main_t, int, char **, void (*)(void),
+    void (*)(void), void (*)(void), void *);
+typedef void (*exit_t)(int) __attribute__((__noreturn__));
+static main_t real_main = NULL;
+
+static int main_wrapper(int argc, char **argv, char **envp)
+{
+    int result = real_main(argc, argv, envp);
+    exit_begin();
+    return result;
+}
+
+/*
+ * The symbols are always interposed, but the wrappers only step in when an
+ * exit option is set: otherwise main() runs unwrapped, and exit() only costs
+ * a lookup on the way out.  The runtime is initialized by then (see
+ * rezzan_init()), as the constructors of the shared objects and the
+ * preinit_array of the executable run before _start.
+ */
+extern int __libc_start_main(main_t main, int argc, char **argv,
+    void (*init)(void), void (*fini)(void), void (*rtld_fini)(void),
+    void *stack_end)
+{
+    libc_start_main_t libc_start_main =
+        (libc_start_main_t)dlsym(RTLD_NEXT, "__libc_start_main");
+    if (libc_start_main == NULL)
+        error("failed to find libc __libc_start_main()");
+    if (!exit_hooked())
+        return libc_start_main(main, argc, argv, init, fini, rtld_fini,
+            stack_end);
+    real_main = main;
+    return libc_start_main(main_wrapper, argc, argv, init, fini, rtld_fini,
+        stack_end);
+}
+
+extern void exit(int status)
+{
+    static exit_t libc_exit = NULL;
+    if (libc_exit == NULL)
+    {
+        libc_exit = (exit_t)dlsym(RTLD_NEXT, "exit");
+        if (libc_exit == NULL)
+            error("failed to find libc exit()");
+    }
+    if (exit_hooked())
+        exit_begin();
+    libc_exit(status);
+}
+
+/*
+ * Run new threads with their stack registered (see region_tokens()).
+ */
+typedef int (*pthread_create_t)(pthread_t *, const pthread_attr_t *,
+    void *(*)(void *), void *);
+typedef struct
+{
+    void *(*start)(void *);
+    void *arg;
+} ThreadStart;
+
+static void thread_exit(void *slot)
+{
+    __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELEASE);
+    region_remove((ssize_t)slot);
+}
+
+static void *thread_main(void *arg)
+{
+    ThreadStart start = *(ThreadStart *)arg;
+    free(arg);
+
+    ssize_t slot = -1;
+    pthread_attr_t attr;
+    void *stack = NULL;
+    size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        (void)pthread_attr_getstack(&attr, &stack, &size);
+        pthread_attr_destroy(&attr);
+    }
+    if (!(option_scopes & SCOPE_STACK))
+        size = 0;           // No tokens on the stack
+    else if (size == 0)
+        __atomic_store_n(&region_full, true, __ATOMIC_RELEASE);
+    if (size != 0)
+        slot = region_add((uintptr_t)stack, (uintptr_t)stack + size);
+    thread_started = true;
+    __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELEASE);
+
+    void *result;
+    pthread_cleanup_push(thread_exit, (void *)slot);
+    result = start.start(start.arg);
+    pthread_cleanup_pop(1);
+    return result;
+}
+
+extern int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+    void *(*start_routine)(void *), void *arg)
+{
+    static pthread_create_t libc_pthread_create = NULL;
+    if (libc_pthread_create == NULL)
+    {
+        // May be missing if libpthread is not linked (glibc < 2.34):
+        libc_pthread_create =
+            (pthread_create_t)dlsym(RTLD_NEXT, "pthread_create");
+        if (libc_pthread_create == NULL)
+            return EAGAIN;
+    }
+    ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+    if (start == NULL)
+        return EAGAIN;
+    start->start = start_routine;
+    start->arg   = arg;
+    int result = libc_pthread_create(thread, attr, thread_main, start);
+    if (result != 0)
+        free(start);
+    return result;
+}
 
 extern void *malloc(size_t size) REZZAN_ALIAS("rezzan_malloc");
 extern void free(void *ptr) REZZAN_ALIAS("rezzan_free");
@@ -1052,12 +3088,17 @@ extern void *_ZnwmRKSt9nothrow_t(size_t size) REZZAN_ALIAS("rezzan_malloc");
 extern void *_ZnamRKSt9nothrow_t(size_t size) REZZAN_ALIAS("rezzan_malloc");
 extern void _ZdlPv(void *ptr) REZZAN_ALIAS("rezzan_free");
 extern void _ZdaPv(void *ptr) REZZAN_ALIAS("rezzan_free");
+extern void *memcpy(void *dst, const void *src, size_t n)
+    REZZAN_ALIAS("rezzan_memcpy");
+
+// Slow path of __rezzan_memcpy_inline() (see rezzan_inline.c):
+extern void *__rezzan_memcpy(void *dst, const void *src, size_t n)
+    REZZAN_ALIAS("rezzan_memcpy");
 
 typedef size_t (*malloc_usable_size_t)(void *);
 extern size_t malloc_usable_size(void *ptr)
 {
-    Unit *ptr128 = (Unit *)ptr;
-    if (ptr128 < pool || ptr128 >= pool + pool_size)
+    if (!heap_contains(ptr))
     {
         // Not allocated by us...
         static malloc_usable_size_t libc_malloc_usable_size = NULL;
@@ -1073,7 +3114,8 @@ extern size_t malloc_usable_size(void *ptr)
 
     size_t size64 = 0;
     Token *ptr64 = (Token *)ptr;
-    while (!is_poisoned(ptr64++))
+    size_t max64 = (lowfat_contains(ptr)? lowfat_size64(ptr) - 1: SIZE_MAX);
+    while (size64 < max64 && !is_poisoned(ptr64++))
         size64++;
     return size64 * sizeof(Token);
 }